@@ -6,407 +6,5488 @@
  * version uses a single alarm thread, which reads the next
  * entry in a list. The main thread places new requests onto the
  * list, in order of absolute expiration time. The list is
- * protected by a mutex, and the alarm thread sleeps for at
- * least 1 second, each iteration, to ensure that the main
- * thread can lock the mutex to add new work to the list.
+ * protected by a mutex, and the alarm thread waits on a
+ * condition variable until the earliest deadline, so that the
+ * main thread can add new work and wake it when that deadline
+ * moves.
+ *
+ * Each alarm also carries a priority class. Pending alarms are kept
+ * in one deadline heap per class, and when several alarms are due at
+ * once the alarm thread always dispatches from the most urgent class
+ * first.
+ *
+ * The pending store, the lock and the clock are chosen at compile
+ * time so the configured hot path inlines fully:
+ *
+ *   -DALARM_STORE=ALARM_STORE_HEAP    binary heap per class (default)
+ *   -DALARM_STORE=ALARM_STORE_LIST    deadline-sorted list per class
+ *   -DALARM_STORE=ALARM_STORE_WHEEL   hashed timing wheel per class
+ *   -DALARM_STORE=ALARM_STORE_RADIX   radix heap per class
+ *   -DALARM_STORE=ALARM_STORE_SKIPLIST lock-free skip list per class
+ *   -DALARM_STORE=ALARM_STORE_CALENDAR calendar queue per class
+ *   -DALARM_LOCK=ALARM_LOCK_MUTEX     plain mutex (default)
+ *   -DALARM_LOCK=ALARM_LOCK_ADAPTIVE  spin-then-block mutex
+ *   -DALARM_CLOCK=ALARM_CLOCK_PRECISE CLOCK_REALTIME, CLOCK_MONOTONIC (default)
+ *   -DALARM_CLOCK=ALARM_CLOCK_COARSE  their _COARSE variants
+ *   -DALARM_CLOCK=ALARM_CLOCK_VIRTUAL simulated time (see below)
+ *
+ * The lock policies only choose how alarm_mutex itself blocks, since
+ * every condition variable here pairs with it. The other two ways of
+ * locking are chosen at run time instead: a thread can shard its
+ * alarms into its own heap (local_alarm_start below), and
+ * --combining hands each operation to whichever thread owns the
+ * lock, like a single-owner queue.
+ *
+ * Running the program as "alarm_mutex --bench N [uniform|mixed]"
+ * times the selected combination on N alarms, with durations either
+ * uniform over an hour or log-uniform from a second to a day;
+ * bench_policies.sh builds and runs every combination in turn.
+ * "alarm_mutex --bench-skiplist N" runs N inserts from 1 to 64
+ * producer threads into the lock-free skip list against one popping
+ * consumer, with and without a global mutex around every operation.
+ *
+ * "alarm_mutex --fire-threads N" fans each expiry slice out to N
+ * firing threads through a relaxed MultiQueue, so alarms due together
+ * are reported in parallel and only roughly in deadline order;
+ * "alarm_mutex --bench-multiqueue N THREADS" measures its pop
+ * throughput and rank error against a single strict heap.
+ *
+ * Threads that start and cancel their own alarms can use
+ * local_alarm_start() and local_alarm_cancel() instead, which keep
+ * the alarm in a per-thread heap and never take alarm_mutex.
+ *
+ * "alarm_mutex --combining" applies inserts, cancels and replaces
+ * by flat combining rather than one lock hold each, and
+ * "alarm_mutex --bench-combining N THREADS" compares the two from 1
+ * to THREADS threads.
+ *
+ * With the virtual clock nothing ever sleeps in real time: once the
+ * alarm thread and every display thread are idle, time jumps to the
+ * next deadline or display tick. An input line "@T command" first
+ * advances to T seconds after start-up, and at end of input the
+ * remaining alarms are run to completion, so hours of alarms replay
+ * through the whole engine in moments.
+ *
+ * "Cancel_Group(n)" and "Cancel_Range(a-b)" cancel many alarms in one
+ * pass and "Start_Alarms: id T message; id T message; ..." starts up
+ * to 16 in one lock hold, each with a single display thread check.
+ * "Shift_All: T" postpones every pending alarm by T seconds in
+ * constant time; "Shift_Group(n): T" postpones one group's.
+ * "Pause_Alarm(id)" freezes an alarm's remaining time until
+ * "Resume_Alarm(id)"; Pause_Group(n) and Resume_Group(n) do a group.
+ *
+ * Start_Alarm deadlines run on the monotonic clock, so setting the
+ * system clock does not move them. "Start_Alarm_At(id): EPOCH
+ * message" instead starts an alarm due at a wall clock time, which
+ * follows the system clock when it is set.
+ *
+ * "alarm_mutex --stress THREADS OPS" fires random interleaved
+ * commands from many threads and audits every index as it goes;
+ * build it with -fsanitize=thread to catch races. Building with
+ * -DALARM_FUZZ -fsanitize=fuzzer turns processInput into a libFuzzer
+ * target instead of a program.
+ *
+ * "Pull_Alarm(id): T message" starts an alarm that is not printed on
+ * expiry but queued for "Take_Expired" (one) or "Take_Expired(n)" (a
+ * batch), which block until something has expired;
+ * alarm_start_pull(), alarm_take() and alarm_take_batch() are the
+ * same for embedders.
+ *
+ * "alarm_mutex --events FILE" also publishes every expiry and display
+ * line into a shared-memory ring in FILE, which any number of local
+ * processes can follow; "alarm_mutex --subscribe FILE" is one.
+ * "alarm_mutex --commands FILE" accepts commands the other way, as
+ * fixed-size records that local clients write into a shared-memory
+ * ring without a syscall; "alarm_mutex --submit FILE" is a client.
+ *
+ * "alarm_mutex --load RATE SECONDS" drives the engine open loop at
+ * RATE commands a second and reports acknowledgement and fire
+ * lateness percentiles measured from the intended send times.
+ *
+ * Building with -DALARM_TRACE records every alarm's lifecycle into
+ * per-thread binary ring buffers; Trace_Dump(file) writes them out
+ * and "alarm_mutex --trace-to-chrome file" converts a dump to the
+ * Chrome trace event format. Without the flag the trace points
+ * compile to nothing.
  */
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include "errors.h"
 
+#define ALARM_STORE_HEAP        1
+#define ALARM_STORE_LIST        2
+#define ALARM_STORE_WHEEL       3
+#define ALARM_STORE_RADIX       4
+#define ALARM_STORE_SKIPLIST    5
+#define ALARM_STORE_CALENDAR    6
+#define ALARM_LOCK_MUTEX        1
+#define ALARM_LOCK_ADAPTIVE     2
+#define ALARM_CLOCK_PRECISE     1
+#define ALARM_CLOCK_COARSE      2
+#define ALARM_CLOCK_VIRTUAL     3
+
+#ifndef ALARM_STORE
+#define ALARM_STORE ALARM_STORE_HEAP
+#endif
+#ifndef ALARM_LOCK
+#define ALARM_LOCK ALARM_LOCK_MUTEX
+#endif
+#ifndef ALARM_CLOCK
+#define ALARM_CLOCK ALARM_CLOCK_PRECISE
+#endif
+
+/*
+ * The "alarm" structure now contains the time_t deadline for each
+ * alarm, so that they can be sorted. Storing the requested number
+ * of seconds would not be enough, since the "alarm thread" cannot
+ * tell how long it has been on the list. The deadline is on the
+ * monotonic clock (see alarm_clock), except for a Start_Alarm_At
+ * alarm waiting on the wall heap, whose deadline is seconds since
+ * the Epoch.
+ */
+struct alarm_tag;
+
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Completion hook for alarms registered through alarm_await(). It is
+ * called on the alarm thread, without alarm_mutex held, instead of
+ * printing the alarm; the alarm is freed once it returns.
  */
+typedef void (*alarm_fire_fn)(struct alarm_tag *alarm, void *context);
+
 typedef struct alarm_tag {
     struct alarm_tag    *link;
+    struct alarm_tag    *prev;          /* back link in alarm_list */
     int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
+    time_t              time;   /* deadline: alarm_clock(), or EPOCH if wall_index >= 0 */
     char                message[128];
     int                 id;
     int                 Alarm_Time_Group_Number;    
+    int                 priority;       /* 0 is the most urgent class */
+    int                 heap_index;     /* position in its priority heap */
+    struct alarm_tag    *store_next;    /* list and wheel store links */
+    struct alarm_tag    *store_prev;
+    void                *store_node;    /* skip list store node */
+    alarm_fire_fn       on_fire;        /* NULL: print the alarm */
+    void                *context;
+    int                 slot;           /* handle table entry */
+    struct alarm_tag    *id_next;       /* id index hash chain */
+    int                 paused;         /* listed but not in its store */
+    time_t              remaining;      /* seconds left when paused */
+    int                 wall_index;     /* position in wall_alarms, or -1 */
 } alarm_t;
 
+#define ALARM_PRIORITIES        4
+#define ALARM_PRIORITY_DEFAULT  2
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-alarm_t *alarm_list = NULL;
+/*
+ * Current time in seconds from EPOCH, read through the configured
+ * clock. The coarse clock avoids the TSC read and is plenty for
+ * whole-second deadlines. The virtual clock only moves when
+ * clock_advance() moves it.
+ */
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+atomic_long virtual_now;
 
-typedef struct display_thread {
-    pthread_t thread_id;
-    int time_group_number;
-} display_t;
+static inline time_t alarm_now(void) {
+    return atomic_load(&virtual_now);
+}
+#else
+static inline time_t alarm_now(void) {
+    struct timespec now;
 
-display_t display_threads[100];
-pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
+#if ALARM_CLOCK == ALARM_CLOCK_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+    clock_gettime(CLOCK_REALTIME, &now);
+#endif
+    return now.tv_sec;
+}
+#endif
 
-void* display_alarm_thread(void *arg) {
-    int group_number = *(int*)arg;  // Set the group number from the passed argument
-    free(arg);  // Free the dynamically allocated memory for group number
+/*
+ * Deadlines of relative alarms are kept on the monotonic clock, so
+ * setting the system clock neither fires them early nor holds them
+ * back; alarm_now() remains the clock everything is reported in.
+ * deadline_wall() converts such a deadline for reporting.
+ */
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+static inline time_t alarm_clock(void) {
+    return alarm_now();
+}
+#else
+static inline time_t alarm_clock(void) {
+    struct timespec now;
+
+#if ALARM_CLOCK == ALARM_CLOCK_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return now.tv_sec;
+}
+#endif
+
+static inline time_t deadline_wall(time_t deadline) {
+    return deadline + alarm_now() - alarm_clock();
+}
+
+static inline int store_before(alarm_t *a, alarm_t *b) {
+    if (a->time != b->time)
+        return a->time < b->time;
+    return a->id < b->id;
+}
+
+/*
+ * Lock-free skip list ordered by (time, id), after Herlihy and
+ * Shavit. The low bit of a next pointer marks the node that owns it
+ * as deleted at that level; a node belongs to whoever marks its
+ * bottom level, so a cancel and a pop racing for the same alarm
+ * cannot both win. Marked nodes are unlinked by whichever traversal
+ * passes them. Nodes are never freed here: the caller frees a node it
+ * removed once no other thread can still be traversing it (under
+ * alarm_mutex that is immediately).
+ */
+#define SKIP_MAX_LEVEL          24
+
+typedef struct skip_node {
+    time_t              time;
+    int                 id;
+    int                 top_level;
+    alarm_t             *alarm;
+    _Atomic(uintptr_t)  next[];
+} skip_node_t;
+
+typedef struct skip_list {
+    skip_node_t         *head;
+    skip_node_t         *tail;
+    atomic_int          count;
+} skip_list_t;
+
+#define SKIP_MARKED(p)  ((p) & 1)
+#define SKIP_PTR(p)     ((skip_node_t *)((p) & ~(uintptr_t)1))
+
+skip_node_t *skip_node_new(time_t time, int id, int top_level) {
+    skip_node_t *node;
+
+    node = malloc(sizeof(skip_node_t) + (top_level + 1) * sizeof(_Atomic(uintptr_t)));
+    if (node == NULL)
+        errno_abort("Allocate skip list node");
+    node->time = time;
+    node->id = id;
+    node->top_level = top_level;
+    node->alarm = NULL;
+    return node;
+}
+
+/*
+ * Per-thread xorshift, so concurrent structures do not contend on
+ * rand().
+ */
+static inline unsigned int thread_random(void) {
+    static __thread unsigned int seed = 0;
+
+    if (seed == 0)
+        seed = (unsigned int)(uintptr_t)&seed | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Geometric level with p = 1/2
+int skip_random_level(void) {
+    return __builtin_ctz(thread_random() | 1u << (SKIP_MAX_LEVEL - 1));
+}
+
+void skip_init(skip_list_t *list) {
+    int level;
+
+    list->head = skip_node_new(0, 0, SKIP_MAX_LEVEL - 1);
+    list->tail = skip_node_new(0, 0, SKIP_MAX_LEVEL - 1);
+    for (level = 0; level < SKIP_MAX_LEVEL; level++) {
+        atomic_init(&list->head->next[level], (uintptr_t)list->tail);
+        atomic_init(&list->tail->next[level], 0);
+    }
+    atomic_init(&list->count, 0);
+}
+
+void skip_destroy(skip_list_t *list) {
+    free(list->head);
+    free(list->tail);
+    list->head = list->tail = NULL;
+}
+
+static inline int skip_before(skip_list_t *list, skip_node_t *node, time_t time, int id) {
+    if (node == list->tail)
+        return 0;
+    if (node->time != time)
+        return node->time < time;
+    return node->id < id;
+}
+
+/*
+ * Fill preds/succs with the nodes either side of (time, id) at every
+ * level, unlinking any marked node on the way. Returns 1 if succs[0]
+ * is exactly (time, id).
+ */
+int skip_find(skip_list_t *list, time_t time, int id,
+              skip_node_t **preds, skip_node_t **succs) {
+    skip_node_t *pred, *curr;
+    uintptr_t succ;
+    int level;
+
+retry:
+    pred = list->head;
+    for (level = SKIP_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = SKIP_PTR(atomic_load(&pred->next[level]));
+        while (1) {
+            succ = atomic_load(&curr->next[level]);
+            while (SKIP_MARKED(succ)) {
+                uintptr_t expected = (uintptr_t)curr;
+
+                if (!atomic_compare_exchange_strong(&pred->next[level], &expected, (uintptr_t)SKIP_PTR(succ)))
+                    goto retry;
+                curr = SKIP_PTR(succ);
+                succ = atomic_load(&curr->next[level]);
+            }
+            if (!skip_before(list, curr, time, id))
+                break;
+            pred = curr;
+            curr = SKIP_PTR(succ);
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+    return succs[0] != list->tail && succs[0]->time == time && succs[0]->id == id;
+}
+
+/*
+ * Link node in. It becomes visible once the bottom level CAS succeeds;
+ * the upper levels are only shortcuts and are built afterwards,
+ * giving up if the node is deleted meanwhile. Returns 0 if a node
+ * with the same (time, id) is already present.
+ */
+int skip_insert(skip_list_t *list, skip_node_t *node) {
+    skip_node_t *preds[SKIP_MAX_LEVEL], *succs[SKIP_MAX_LEVEL];
+    uintptr_t expected, next;
+    int level;
 
-    time_t current_time;
     while (1) {
-        pthread_mutex_lock(&alarm_mutex);
-        for (alarm_t *alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
-            if (alarm->Alarm_Time_Group_Number == group_number) {
-                time(&current_time);
-                printf("Alarm (%d) Printed by Alarm Thread %lu for Alarm_Time_Group_Number %d at %ld: %s\n",
-                       alarm->id,
-                       (unsigned long)pthread_self(),
-                       group_number,
-                       current_time,
-                       alarm->message);
+        if (skip_find(list, node->time, node->id, preds, succs))
+            return 0;
+        for (level = 0; level <= node->top_level; level++)
+            atomic_store(&node->next[level], (uintptr_t)succs[level]);
+        expected = (uintptr_t)succs[0];
+        if (atomic_compare_exchange_strong(&preds[0]->next[0], &expected, (uintptr_t)node))
+            break;
+    }
+    atomic_fetch_add(&list->count, 1);
+    for (level = 1; level <= node->top_level; level++) {
+        while (1) {
+            // Point the node at its current successor before linking it
+            next = atomic_load(&node->next[level]);
+            if (SKIP_MARKED(next))
+                return 1;
+            if (SKIP_PTR(next) != succs[level]
+                && !atomic_compare_exchange_strong(&node->next[level], &next, (uintptr_t)succs[level]))
+                return 1;
+            expected = (uintptr_t)succs[level];
+            if (atomic_compare_exchange_strong(&preds[level]->next[level], &expected, (uintptr_t)node))
+                break;
+            skip_find(list, node->time, node->id, preds, succs);
+            if (succs[0] != node)
+                return 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Delete node: mark it top down, then race for the bottom level.
+ * Returns 1 if this caller won and the node is now unlinked.
+ */
+int skip_remove(skip_list_t *list, skip_node_t *node) {
+    skip_node_t *preds[SKIP_MAX_LEVEL], *succs[SKIP_MAX_LEVEL];
+    uintptr_t next;
+    int level;
+
+    for (level = node->top_level; level >= 1; level--) {
+        next = atomic_load(&node->next[level]);
+        while (!SKIP_MARKED(next))
+            atomic_compare_exchange_weak(&node->next[level], &next, next | 1);
+    }
+    next = atomic_load(&node->next[0]);
+    while (!SKIP_MARKED(next)) {
+        if (atomic_compare_exchange_strong(&node->next[0], &next, next | 1)) {
+            atomic_fetch_sub(&list->count, 1);
+            skip_find(list, node->time, node->id, preds, succs);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+skip_node_t *skip_first(skip_list_t *list) {
+    skip_node_t *node = SKIP_PTR(atomic_load(&list->head->next[0]));
+
+    while (node != list->tail && SKIP_MARKED(atomic_load(&node->next[0])))
+        node = SKIP_PTR(atomic_load(&node->next[0]));
+    return node == list->tail ? NULL : node;
+}
+
+/*
+ * Remove and return the earliest node, or NULL if the list is empty.
+ * Losing the race for a node just moves on to the next one.
+ */
+skip_node_t *skip_pop(skip_list_t *list) {
+    skip_node_t *node;
+
+    while ((node = skip_first(list)) != NULL)
+        if (skip_remove(list, node))
+            return node;
+    return NULL;
+}
+
+/*
+ * Pending store, one per priority class, ordered by expiration time
+ * (then id). alarm_list stays ordered by id for lookups and the
+ * display threads; the stores only decide firing order. Every
+ * backend provides store_push, store_remove, store_top, store_count
+ * and store_pop. store_pop removes the alarm store_top returned
+ * because it is being fired; after that no alarm due earlier than it
+ * is pushed, which is what lets the radix heap stay monotone.
+ */
+#if ALARM_STORE == ALARM_STORE_HEAP
+
+#define ALARM_STORE_NAME "heap"
+
+typedef struct alarm_heap {
+    alarm_t             **items;
+    int                 count;
+    int                 size;
+} alarm_heap_t;
+
+static void heap_set(alarm_heap_t *heap, int i, alarm_t *alarm) {
+    heap->items[i] = alarm;
+    alarm->heap_index = i;
+}
+
+static void heap_sift_up(alarm_heap_t *heap, int i) {
+    alarm_t *alarm = heap->items[i];
+
+    while (i > 0 && store_before(alarm, heap->items[(i - 1) / 2])) {
+        heap_set(heap, i, heap->items[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(heap, i, alarm);
+}
+
+static void heap_sift_down(alarm_heap_t *heap, int i) {
+    alarm_t *alarm = heap->items[i];
+    int child;
+
+    while ((child = 2 * i + 1) < heap->count) {
+        if (child + 1 < heap->count
+            && store_before(heap->items[child + 1], heap->items[child]))
+            child++;
+        if (!store_before(heap->items[child], alarm))
+            break;
+        heap_set(heap, i, heap->items[child]);
+        i = child;
+    }
+    heap_set(heap, i, alarm);
+}
+
+static inline void heap_push(alarm_heap_t *heap, alarm_t *alarm) {
+    if (heap->count == heap->size) {
+        int size = heap->size ? heap->size * 2 : 64;
+        alarm_t **items = realloc(heap->items, size * sizeof(alarm_t *));
+
+        if (items == NULL)
+            errno_abort("Grow alarm heap");
+        heap->items = items;
+        heap->size = size;
+    }
+    heap_set(heap, heap->count, alarm);
+    heap_sift_up(heap, heap->count++);
+}
+
+static inline void heap_remove(alarm_heap_t *heap, alarm_t *alarm) {
+    int i = alarm->heap_index;
+
+    if (i < 0 || i >= heap->count || heap->items[i] != alarm)
+        return;
+    heap->count--;
+    if (i != heap->count) {
+        heap_set(heap, i, heap->items[heap->count]);
+        heap_sift_up(heap, i);
+        heap_sift_down(heap, heap->items[i]->heap_index);
+    }
+    alarm->heap_index = -1;
+}
+
+static inline alarm_t *heap_top(alarm_heap_t *heap) {
+    return heap->count > 0 ? heap->items[0] : NULL;
+}
+
+typedef alarm_heap_t alarm_store_t;
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    heap_push(store, alarm);
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    heap_remove(store, alarm);
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    return heap_top(store);
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->count;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    store_remove(store, alarm);
+}
+
+#elif ALARM_STORE == ALARM_STORE_LIST
+
+#define ALARM_STORE_NAME "list"
+
+/*
+ * Doubly linked list kept in deadline order: O(n) insert, O(1)
+ * removal and O(1) access to the earliest alarm.
+ */
+typedef struct alarm_store {
+    alarm_t             *head;
+    int                 count;
+} alarm_store_t;
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    alarm_t **last = &store->head, *prev = NULL;
+
+    while (*last != NULL && store_before(*last, alarm)) {
+        prev = *last;
+        last = &(*last)->store_next;
+    }
+    alarm->store_next = *last;
+    alarm->store_prev = prev;
+    if (*last != NULL)
+        (*last)->store_prev = alarm;
+    *last = alarm;
+    store->count++;
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    if (alarm->store_prev != NULL)
+        alarm->store_prev->store_next = alarm->store_next;
+    else if (store->head == alarm)
+        store->head = alarm->store_next;
+    else
+        return;
+    if (alarm->store_next != NULL)
+        alarm->store_next->store_prev = alarm->store_prev;
+    alarm->store_next = alarm->store_prev = NULL;
+    store->count--;
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    return store->head;
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->count;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    store_remove(store, alarm);
+}
+
+#elif ALARM_STORE == ALARM_STORE_WHEEL
+
+#define ALARM_STORE_NAME "wheel"
+#define WHEEL_SLOTS     256     /* one slot per second, power of two */
+
+/*
+ * Hashed timing wheel: slot (time % WHEEL_SLOTS) holds an unsorted
+ * list of alarms, so push and remove are O(1). The earliest alarm is
+ * cached and only searched for again after it has been removed; the
+ * search walks forward one second per slot from the old minimum.
+ */
+typedef struct alarm_store {
+    alarm_t             *slots[WHEEL_SLOTS];
+    alarm_t             *min;
+    time_t              min_time;       /* no alarm is due before this */
+    int                 count;
+} alarm_store_t;
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    alarm_t **slot = &store->slots[alarm->time & (WHEEL_SLOTS - 1)];
+
+    alarm->store_prev = NULL;
+    alarm->store_next = *slot;
+    if (*slot != NULL)
+        (*slot)->store_prev = alarm;
+    *slot = alarm;
+    if (store->count++ == 0 || alarm->time < store->min_time)
+        store->min_time = alarm->time;
+    if (store->min != NULL && store_before(alarm, store->min))
+        store->min = alarm;
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    alarm_t **slot = &store->slots[alarm->time & (WHEEL_SLOTS - 1)];
+
+    if (alarm->store_prev != NULL)
+        alarm->store_prev->store_next = alarm->store_next;
+    else if (*slot == alarm)
+        *slot = alarm->store_next;
+    else
+        return;
+    if (alarm->store_next != NULL)
+        alarm->store_next->store_prev = alarm->store_prev;
+    alarm->store_next = alarm->store_prev = NULL;
+    store->count--;
+    if (store->min == alarm)
+        store->min = NULL;
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    alarm_t *alarm, *best = NULL;
+    time_t t;
+    int i;
+
+    if (store->min != NULL || store->count == 0)
+        return store->min;
+    // Look one revolution ahead for an exact deadline match
+    for (t = store->min_time; t < store->min_time + WHEEL_SLOTS; t++) {
+        for (alarm = store->slots[t & (WHEEL_SLOTS - 1)]; alarm != NULL; alarm = alarm->store_next)
+            if (alarm->time == t && (best == NULL || alarm->id < best->id))
+                best = alarm;
+        if (best != NULL)
+            break;
+    }
+    // Everything is more than a revolution away: scan all slots
+    for (i = 0; t == store->min_time + WHEEL_SLOTS && i < WHEEL_SLOTS; i++)
+        for (alarm = store->slots[i]; alarm != NULL; alarm = alarm->store_next)
+            if (best == NULL || store_before(alarm, best))
+                best = alarm;
+    store->min = best;
+    store->min_time = best->time;
+    return best;
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->count;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    store_remove(store, alarm);
+}
+
+#elif ALARM_STORE == ALARM_STORE_RADIX
+
+#define ALARM_STORE_NAME "radix"
+#define RADIX_BUCKETS   65
+
+/*
+ * Radix heap. The alarm thread only ever fires deadlines at or after
+ * the last one it fired, so alarms can be bucketed by the highest bit
+ * in which their deadline differs from that last fired deadline:
+ * bucket 0 holds deadlines equal to it, bucket b those differing
+ * first in bit b-1. Push and cancel are O(1) list operations; firing
+ * the minimum redistributes only its bucket, each alarm moving to a
+ * lower bucket at most 64 times over its life. heap_index records the
+ * bucket. Alarms already overdue when pushed (negative durations, the
+ * clock stepping back) are keyed at the last fired deadline, and
+ * alarms due in the same second come out in no particular id order.
+ */
+typedef struct alarm_store {
+    alarm_t             *buckets[RADIX_BUCKETS];
+    alarm_t             *min;
+    time_t              last;           /* deadline of the last alarm fired */
+    int                 count;
+} alarm_store_t;
+
+static inline time_t radix_key(alarm_store_t *store, alarm_t *alarm) {
+    return alarm->time > store->last ? alarm->time : store->last;
+}
+
+static inline int radix_bucket(alarm_store_t *store, time_t key) {
+    unsigned long diff = (unsigned long)key ^ (unsigned long)store->last;
+
+    return diff == 0 ? 0 : 64 - __builtin_clzl(diff);
+}
+
+static inline void radix_link(alarm_store_t *store, alarm_t *alarm) {
+    int bucket = radix_bucket(store, radix_key(store, alarm));
+
+    alarm->heap_index = bucket;
+    alarm->store_prev = NULL;
+    alarm->store_next = store->buckets[bucket];
+    if (alarm->store_next != NULL)
+        alarm->store_next->store_prev = alarm;
+    store->buckets[bucket] = alarm;
+}
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    radix_link(store, alarm);
+    store->count++;
+    if (store->min != NULL && store_before(alarm, store->min))
+        store->min = alarm;
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    int bucket = alarm->heap_index;
+
+    if (bucket < 0 || bucket >= RADIX_BUCKETS)
+        return;
+    if (alarm->store_prev != NULL)
+        alarm->store_prev->store_next = alarm->store_next;
+    else if (store->buckets[bucket] == alarm)
+        store->buckets[bucket] = alarm->store_next;
+    else
+        return;
+    if (alarm->store_next != NULL)
+        alarm->store_next->store_prev = alarm->store_prev;
+    alarm->store_next = alarm->store_prev = NULL;
+    alarm->heap_index = -1;
+    store->count--;
+    if (store->min == alarm)
+        store->min = NULL;
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    alarm_t *alarm;
+    int b;
+
+    if (store->min != NULL || store->count == 0)
+        return store->min;
+    for (b = 0; store->buckets[b] == NULL; b++)
+        ;
+    store->min = store->buckets[b];
+    if (b > 0)
+        for (alarm = store->min->store_next; alarm != NULL; alarm = alarm->store_next)
+            if (store_before(alarm, store->min))
+                store->min = alarm;
+    return store->min;
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->count;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    time_t key = radix_key(store, alarm);
+    int bucket = alarm->heap_index;
+    alarm_t *rest, *next;
+
+    store_remove(store, alarm);
+    if (key == store->last)
+        return;
+    // Advance to the fired deadline and re-bucket what shared its bucket
+    store->last = key;
+    rest = store->buckets[bucket];
+    store->buckets[bucket] = NULL;
+    for (; rest != NULL; rest = next) {
+        next = rest->store_next;
+        radix_link(store, rest);
+    }
+}
+
+#elif ALARM_STORE == ALARM_STORE_SKIPLIST
+
+#define ALARM_STORE_NAME "skiplist"
+
+/*
+ * The engine still calls the store under alarm_mutex, so a removed
+ * node can be freed at once; the list itself needs no lock, which is
+ * what --bench-skiplist measures.
+ */
+typedef skip_list_t alarm_store_t;
+
+static inline void store_ready(alarm_store_t *store) {
+    if (store->head == NULL)
+        skip_init(store);
+}
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    skip_node_t *node = skip_node_new(alarm->time, alarm->id, skip_random_level());
+
+    store_ready(store);
+    node->alarm = alarm;
+    alarm->store_node = node;
+    skip_insert(store, node);
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    skip_node_t *node = alarm->store_node;
+
+    if (node == NULL)
+        return;
+    if (skip_remove(store, node))
+        free(node);
+    alarm->store_node = NULL;
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    skip_node_t *node;
+
+    store_ready(store);
+    node = skip_first(store);
+    return node != NULL ? node->alarm : NULL;
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->head != NULL ? atomic_load(&store->count) : 0;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    store_remove(store, alarm);
+}
+
+#elif ALARM_STORE == ALARM_STORE_CALENDAR
+
+#define ALARM_STORE_NAME "calendar"
+#define CALENDAR_MIN_BUCKETS    16
+#define CALENDAR_SAMPLE         25
+
+/*
+ * Calendar queue (Brown, 1988). Deadlines hash into "days" of width
+ * seconds in a "year" of nbuckets days; each day is a list sorted by
+ * time. The minimum is found by walking forward from the
+ * current day, taking a day's head only if it falls within this year,
+ * and falling back to a scan of every head after a full empty year.
+ * The calendar doubles or halves with the population, re-deriving
+ * the day width from the spread of pending deadlines, so for evenly
+ * spread deadlines each day holds a couple of alarms and push and pop
+ * are O(1) expected. heap_index records the day. A new alarm goes
+ * ahead of any due in the same second, so a burst of equal deadlines
+ * costs nothing to insert but fires in no particular id order.
+ */
+typedef struct alarm_store {
+    alarm_t             **buckets;
+    int                 nbuckets;       /* power of two */
+    time_t              width;          /* seconds per bucket */
+    int                 count;
+    int                 current;        /* bucket the search resumes at */
+    time_t              bucket_top;     /* end of current in this year */
+    alarm_t             *min;
+} alarm_store_t;
+
+static inline int calendar_bucket(alarm_store_t *store, time_t time) {
+    return (int)(((unsigned long)time / store->width) & (store->nbuckets - 1));
+}
+
+static inline void calendar_seek(alarm_store_t *store, time_t time) {
+    store->current = calendar_bucket(store, time);
+    store->bucket_top = ((unsigned long)time / store->width + 1) * store->width;
+}
+
+static inline void calendar_link(alarm_store_t *store, alarm_t *alarm) {
+    int bucket = calendar_bucket(store, alarm->time);
+    alarm_t *prev = NULL, *next = store->buckets[bucket];
+
+    while (next != NULL && next->time < alarm->time) {
+        prev = next;
+        next = next->store_next;
+    }
+    alarm->heap_index = bucket;
+    alarm->store_prev = prev;
+    alarm->store_next = next;
+    if (prev != NULL)
+        prev->store_next = alarm;
+    else
+        store->buckets[bucket] = alarm;
+    if (next != NULL)
+        next->store_prev = alarm;
+}
+
+/*
+ * Rebuild with nbuckets days. As in Brown's paper the day width is
+ * three times the average gap between the earliest pending deadlines,
+ * ignoring gaps more than twice the mean, so the dense front of the
+ * queue gets narrow days however long the tail is.
+ */
+void calendar_resize(alarm_store_t *store, int nbuckets) {
+    alarm_t **old = store->buckets, *alarm, *next, *all = NULL;
+    time_t sample[CALENDAR_SAMPLE], lo = 0, gap, total = 0, kept = 0;
+    int i, j, n = 0, used = 0, old_count = store->nbuckets;
+
+    for (i = 0; i < old_count; i++) {
+        for (alarm = old[i]; alarm != NULL; alarm = next) {
+            next = alarm->store_next;
+            alarm->store_next = all;
+            all = alarm;
+            // Keep the CALENDAR_SAMPLE earliest deadlines, sorted
+            if (n == CALENDAR_SAMPLE && alarm->time >= sample[n - 1])
+                continue;
+            for (j = n < CALENDAR_SAMPLE ? n++ : n - 1; j > 0 && sample[j - 1] > alarm->time; j--)
+                sample[j] = sample[j - 1];
+            sample[j] = alarm->time;
+        }
+    }
+    store->buckets = (alarm_t **)calloc(nbuckets, sizeof(alarm_t *));
+    if (store->buckets == NULL)
+        errno_abort("Resize calendar queue");
+    store->nbuckets = nbuckets;
+    if (n > 1) {
+        lo = sample[0];
+        total = sample[n - 1] - sample[0];
+        for (j = 1; j < n; j++) {
+            gap = sample[j] - sample[j - 1];
+            if (gap * (n - 1) <= 2 * total) {
+                kept += gap;
+                used++;
             }
         }
-        pthread_mutex_unlock(&alarm_mutex);
-        sleep(1);
+    }
+    store->width = used > 0 ? 3 * kept / used : 1;
+    if (store->width < 1)
+        store->width = 1;
+    for (alarm = all; alarm != NULL; alarm = next) {
+        next = alarm->store_next;
+        calendar_link(store, alarm);
+    }
+    free(old);
+    calendar_seek(store, lo);
+    store->min = NULL;
+}
+
+static inline void store_push(alarm_store_t *store, alarm_t *alarm) {
+    if (store->buckets == NULL)
+        calendar_resize(store, CALENDAR_MIN_BUCKETS);
+    calendar_link(store, alarm);
+    if (store->count++ == 0 || alarm->time < store->bucket_top - store->width)
+        calendar_seek(store, alarm->time);
+    if (store->min != NULL && store_before(alarm, store->min))
+        store->min = alarm;
+    if (store->count > 2 * store->nbuckets)
+        calendar_resize(store, store->nbuckets * 2);
+}
+
+static inline void store_remove(alarm_store_t *store, alarm_t *alarm) {
+    int bucket = alarm->heap_index;
+
+    if (bucket < 0 || bucket >= store->nbuckets)
+        return;
+    if (alarm->store_prev != NULL)
+        alarm->store_prev->store_next = alarm->store_next;
+    else if (store->buckets[bucket] == alarm)
+        store->buckets[bucket] = alarm->store_next;
+    else
+        return;
+    if (alarm->store_next != NULL)
+        alarm->store_next->store_prev = alarm->store_prev;
+    alarm->store_next = alarm->store_prev = NULL;
+    alarm->heap_index = -1;
+    store->count--;
+    if (store->min == alarm)
+        store->min = NULL;
+    if (store->nbuckets > CALENDAR_MIN_BUCKETS && store->count < store->nbuckets / 2)
+        calendar_resize(store, store->nbuckets / 2);
+}
+
+static inline alarm_t *store_top(alarm_store_t *store) {
+    alarm_t *head;
+    int i, b;
+
+    if (store->min != NULL || store->count == 0)
+        return store->min;
+    for (i = 0; i < store->nbuckets; i++) {
+        head = store->buckets[store->current];
+        if (head != NULL && head->time < store->bucket_top)
+            return store->min = head;
+        store->current = (store->current + 1) & (store->nbuckets - 1);
+        store->bucket_top += store->width;
+    }
+    // A whole empty year: jump straight to the earliest head
+    for (b = 0; b < store->nbuckets; b++)
+        if (store->buckets[b] != NULL
+            && (store->min == NULL || store_before(store->buckets[b], store->min)))
+            store->min = store->buckets[b];
+    calendar_seek(store, store->min->time);
+    return store->min;
+}
+
+static inline int store_count(alarm_store_t *store) {
+    return store->count;
+}
+
+static inline void store_pop(alarm_store_t *store, alarm_t *alarm) {
+    store_remove(store, alarm);
+}
+
+#else
+#error "Unknown ALARM_STORE"
+#endif
+
+#if ALARM_LOCK == ALARM_LOCK_ADAPTIVE
+#define ALARM_LOCK_NAME "adaptive"
+pthread_mutex_t alarm_mutex = PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP;
+#else
+#define ALARM_LOCK_NAME "mutex"
+pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#if ALARM_CLOCK == ALARM_CLOCK_COARSE
+#define ALARM_CLOCK_NAME "coarse"
+#elif ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+#define ALARM_CLOCK_NAME "virtual"
+#else
+#define ALARM_CLOCK_NAME "precise"
+#endif
+
+pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
+alarm_t *alarm_list = NULL;
+alarm_store_t alarm_stores[ALARM_PRIORITIES];
+
+/*
+ * Waiting on the clock. Display threads tick with clock_sleep(), are
+ * counted in by clock_join() before they are created and out by
+ * clock_leave() as they exit, and anything that wakes the alarm
+ * thread calls clock_kick() under alarm_mutex first. On a real clock
+ * these are just sleep() and no-ops.
+ *
+ * On the virtual clock the alarm thread reports, under virtual_mutex,
+ * when it is idle and its next deadline, and each display thread
+ * parks on virtual_waiters with its wake time. clock_advance(), run
+ * by the thread feeding commands, waits until the alarm thread is
+ * idle and every display thread is parked, then sets the time to the
+ * earliest deadline or wake time, releases whoever is due, and
+ * repeats until it reaches its target. Lock order is alarm_mutex
+ * before virtual_mutex.
+ */
+#define CLOCK_FOREVER           LONG_MAX
+
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+typedef struct virtual_waiter {
+    time_t              wake;
+    int                 parked;         /* cleared by clock_advance */
+    struct virtual_waiter *next;
+} virtual_waiter_t;
+
+pthread_mutex_t virtual_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t virtual_cond = PTHREAD_COND_INITIALIZER;
+virtual_waiter_t *virtual_waiters = NULL;
+int virtual_parked = 0, virtual_threads = 0;
+int virtual_alarm_idle = 0;
+time_t virtual_alarm_next = 0, virtual_start = 0;
+pthread_t virtual_driver;
+
+static void virtual_unpark(void *arg) {
+    virtual_waiter_t *self = (virtual_waiter_t *)arg, **link;
+
+    if (self->parked) {
+        for (link = &virtual_waiters; *link != self; link = &(*link)->next)
+            ;
+        *link = self->next;
+        virtual_parked--;
+    }
+    pthread_mutex_unlock(&virtual_mutex);
+}
+
+void clock_init(void) {
+    virtual_driver = pthread_self();
+    virtual_start = time(NULL);
+    atomic_store(&virtual_now, virtual_start);
+}
+
+void clock_sleep(int seconds) {
+    virtual_waiter_t self;
+
+    pthread_mutex_lock(&virtual_mutex);
+    self.wake = atomic_load(&virtual_now) + seconds;
+    self.parked = 1;
+    self.next = virtual_waiters;
+    virtual_waiters = &self;
+    virtual_parked++;
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_cleanup_push(virtual_unpark, &self);
+    while (self.parked)
+        pthread_cond_wait(&virtual_cond, &virtual_mutex);
+    pthread_cleanup_pop(1);
+}
+
+void clock_join(void) {
+    pthread_mutex_lock(&virtual_mutex);
+    virtual_threads++;
+    pthread_mutex_unlock(&virtual_mutex);
+}
+
+void clock_leave(void *arg) {
+    pthread_mutex_lock(&virtual_mutex);
+    virtual_threads--;
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_mutex_unlock(&virtual_mutex);
+}
+
+void clock_kick(void) {
+    pthread_mutex_lock(&virtual_mutex);
+    virtual_alarm_idle = 0;
+    pthread_mutex_unlock(&virtual_mutex);
+}
+
+/*
+ * Alarm thread only, with alarm_mutex held: nothing is due before
+ * deadline (0 for none), so wait to be kicked.
+ */
+void clock_wait(time_t deadline) {
+    int status;
+
+    pthread_mutex_lock(&virtual_mutex);
+    virtual_alarm_idle = 1;
+    virtual_alarm_next = deadline;
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_mutex_unlock(&virtual_mutex);
+    status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Wait on cond");
+}
+
+/*
+ * Lock virtual_mutex once the alarm thread is idle and every display
+ * thread parked, and return the earliest time anyone waits for (0 for
+ * none).
+ */
+static time_t clock_settle(void) {
+    virtual_waiter_t *waiter;
+    time_t next;
+
+    pthread_mutex_lock(&virtual_mutex);
+    while (!virtual_alarm_idle || virtual_parked < virtual_threads)
+        pthread_cond_wait(&virtual_cond, &virtual_mutex);
+    next = virtual_alarm_next;
+    for (waiter = virtual_waiters; waiter != NULL; waiter = waiter->next)
+        if (next == 0 || waiter->wake < next)
+            next = waiter->wake;
+    return next;
+}
+
+/*
+ * Run the engine up to target (CLOCK_FOREVER: until nothing is left
+ * pending). Only one thread, the one that called clock_init(), may
+ * drive the clock.
+ */
+void clock_advance(time_t target) {
+    virtual_waiter_t *waiter, **link;
+    time_t next;
+    int status;
+
+    while (1) {
+        next = clock_settle();
+        if (next == 0 || next > target) {
+            if (target != CLOCK_FOREVER && target > atomic_load(&virtual_now))
+                atomic_store(&virtual_now, target);
+            pthread_mutex_unlock(&virtual_mutex);
+            return;
+        }
+        atomic_store(&virtual_now, next);
+        for (link = &virtual_waiters; (waiter = *link) != NULL; ) {
+            if (waiter->wake <= next) {
+                *link = waiter->next;
+                waiter->parked = 0;
+                virtual_parked--;
+            } else {
+                link = &waiter->next;
+            }
+        }
+        pthread_cond_broadcast(&virtual_cond);
+        pthread_mutex_unlock(&virtual_mutex);
+
+        status = pthread_mutex_lock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        clock_kick();
+        status = pthread_cond_broadcast(&alarm_cond);
+        if (status != 0)
+            err_abort(status, "Broadcast cond");
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+    }
+}
+
+/*
+ * Step the clock from one deadline to the next until ready() holds.
+ * Returns 0, or -1 if it does not hold with nothing left to wait for.
+ * Any thread but the driver returns 0 at once, as the driver moves
+ * the clock for it.
+ */
+int clock_advance_until(int (*ready)(void)) {
+    time_t next;
+
+    if (!pthread_equal(pthread_self(), virtual_driver))
+        return 0;
+    while (!ready()) {
+        next = clock_settle();
+        pthread_mutex_unlock(&virtual_mutex);
+        if (next == 0)
+            return ready() ? 0 : -1;
+        clock_advance(next);
+    }
+    return 0;
+}
+#else
+static inline void clock_init(void) {
+}
+
+static inline void clock_sleep(int seconds) {
+    sleep(seconds);
+}
+
+static inline void clock_join(void) {
+}
+
+static inline void clock_leave(void *arg) {
+}
+
+static inline void clock_kick(void) {
+}
+#endif
+
+/*
+ * Handle table. Every alarm on alarm_list owns a slot, and clients
+ * get back an opaque handle (generation << 32 | slot) that reaches
+ * the alarm without searching. The slot's generation is bumped when
+ * the alarm leaves the list, so a stale handle is rejected rather
+ * than hitting whichever alarm reuses the slot. Generations start at
+ * 1, so 0 is never a valid handle. Protected by alarm_mutex.
+ */
+typedef struct alarm_slot {
+    alarm_t             *alarm;
+    unsigned int        generation;
+    int                 next_free;
+} alarm_slot_t;
+
+alarm_slot_t *alarm_slots = NULL;
+int slot_count = 0, slot_size = 0, slot_free = -1;
+
+void slot_acquire(alarm_t *alarm) {
+    int slot;
+
+    if (slot_free >= 0) {
+        slot = slot_free;
+        slot_free = alarm_slots[slot].next_free;
+    } else {
+        if (slot_count == slot_size) {
+            int size = slot_size ? slot_size * 2 : 64;
+            alarm_slot_t *slots = realloc(alarm_slots, size * sizeof(alarm_slot_t));
+
+            if (slots == NULL)
+                errno_abort("Grow handle table");
+            alarm_slots = slots;
+            slot_size = size;
+        }
+        slot = slot_count++;
+        alarm_slots[slot].generation = 1;
+    }
+    alarm_slots[slot].alarm = alarm;
+    alarm->slot = slot;
+}
+
+void slot_release(alarm_t *alarm) {
+    alarm_slot_t *entry = &alarm_slots[alarm->slot];
+
+    entry->alarm = NULL;
+    if (++entry->generation == 0)
+        entry->generation = 1;
+    entry->next_free = slot_free;
+    slot_free = alarm->slot;
+}
+
+/*
+ * Id index: a chained hash table over every alarm on alarm_list, so
+ * lookups by id and the duplicate check on insert are O(1). It grows
+ * by doubling once it averages more than one alarm per bucket.
+ * Protected by alarm_mutex.
+ */
+alarm_t **id_buckets = NULL;
+unsigned int id_bucket_count = 0, id_count = 0;
+
+static inline unsigned int id_hash(int id) {
+    return ((unsigned int)id * 2654435761u) & (id_bucket_count - 1);
+}
+
+void id_index_insert(alarm_t *alarm) {
+    alarm_t **buckets, *next;
+    unsigned int count, i, old_count = id_bucket_count;
+
+    if (id_count >= id_bucket_count) {
+        count = id_bucket_count ? id_bucket_count * 2 : 64;
+        buckets = calloc(count, sizeof(alarm_t *));
+        if (buckets == NULL)
+            errno_abort("Grow id index");
+        id_bucket_count = count;
+        for (i = 0; i < old_count; i++) {
+            for (alarm_t *a = id_buckets[i]; a != NULL; a = next) {
+                next = a->id_next;
+                a->id_next = buckets[id_hash(a->id)];
+                buckets[id_hash(a->id)] = a;
+            }
+        }
+        free(id_buckets);
+        id_buckets = buckets;
+    }
+    alarm->id_next = id_buckets[id_hash(alarm->id)];
+    id_buckets[id_hash(alarm->id)] = alarm;
+    id_count++;
+}
+
+void id_index_remove(alarm_t *alarm) {
+    alarm_t **link;
+
+    if (id_bucket_count == 0)
+        return;
+    for (link = &id_buckets[id_hash(alarm->id)]; *link != NULL; link = &(*link)->id_next) {
+        if (*link == alarm) {
+            *link = alarm->id_next;
+            alarm->id_next = NULL;
+            id_count--;
+            return;
+        }
+    }
+}
+
+alarm_t* find(int id) {
+    alarm_t *current;
+
+    if (id_bucket_count == 0)
+        return NULL;
+    for (current = id_buckets[id_hash(id)]; current != NULL; current = current->id_next) {
+        if (current->id == id) {
+            return current; // Alarm found, return a pointer to it
+        }
+    }
+    return NULL; // Alarm not found
+}
+
+unsigned long alarm_handle(alarm_t *alarm) {
+    return (unsigned long)alarm_slots[alarm->slot].generation << 32
+        | (unsigned int)alarm->slot;
+}
+
+alarm_t *handle_lookup(unsigned long handle) {
+    unsigned int slot = handle & 0xffffffffUL;
+
+    if (slot >= (unsigned int)slot_count
+        || alarm_slots[slot].generation != (unsigned int)(handle >> 32))
+        return NULL;
+    return alarm_slots[slot].alarm;
+}
+
+/*
+ * Expiry is done in slices: the alarm thread detaches at most
+ * slice_max_alarms due alarms, or as many as it can in
+ * slice_max_usec, into firing_batch, dispatches them without the
+ * lock, and then lets any commands that queued up meanwhile apply
+ * before starting the next slice. A large burst therefore delays a
+ * command by at most one slice. Set with Expiry_Slice(K): T.
+ */
+#define ALARM_SLICE_MAX         1024
+
+int slice_max_alarms = 64;
+long slice_max_usec = 1000;
+
+/*
+ * The batch being dispatched by the alarm thread. A waiter cancelling
+ * an alarm in the batch blocks on firing_cond until the batch is
+ * done, so its completion hook never runs after the cancel.
+ */
+alarm_t *firing_batch[ALARM_SLICE_MAX];
+int firing_count = 0;
+pthread_cond_t firing_cond = PTHREAD_COND_INITIALIZER;
+pthread_t alarm_thread_id;
+
+/*
+ * Commands being applied by processInput, counted under the epoch
+ * that was current when they were admitted. Between expiry slices
+ * the alarm thread flips commands_epoch and waits on commands_cond
+ * only for the epoch it closed to drain, so commands arriving while
+ * it waits cannot hold expiry back however steadily they come.
+ * Commands leave with a plain atomic decrement; only the last one out
+ * of an epoch, and only while commands_waiting says the alarm thread
+ * is waiting, takes alarm_mutex to wake it. Both sides store before
+ * they load (sequentially consistent), so at least one of them sees
+ * the other and the wakeup cannot be lost.
+ */
+atomic_int commands_pending[2];
+atomic_int commands_epoch;
+atomic_int commands_waiting;
+pthread_cond_t commands_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Offset added to every deadline in the pending stores, so that
+ * Shift_All can postpone them all in O(1). The stores stay ordered
+ * on alarm->time alone; an alarm's real deadline is alarm->time +
+ * alarm_shift until the alarm thread pops it and folds the shift in.
+ * Always 0 with the radix store (see shift_all). Protected by
+ * alarm_mutex.
+ */
+time_t alarm_shift = 0;
+
+/*
+ * Alarms started with Start_Alarm_At follow the wall clock, so they
+ * cannot share the monotonic stores: they wait in wall_alarms, a
+ * binary heap on their epoch deadline, until wall_thread finds them
+ * due and moves them into their store to fire. Protected by
+ * alarm_mutex.
+ */
+alarm_t **wall_alarms = NULL;
+int wall_count = 0, wall_size = 0;
+
+static void wall_set(int i, alarm_t *alarm) {
+    wall_alarms[i] = alarm;
+    alarm->wall_index = i;
+}
+
+static void wall_sift(int i) {
+    alarm_t *alarm = wall_alarms[i];
+    int child;
+
+    while (i > 0 && store_before(alarm, wall_alarms[(i - 1) / 2])) {
+        wall_set(i, wall_alarms[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < wall_count) {
+        if (child + 1 < wall_count && store_before(wall_alarms[child + 1], wall_alarms[child]))
+            child++;
+        if (!store_before(wall_alarms[child], alarm))
+            break;
+        wall_set(i, wall_alarms[child]);
+        i = child;
+    }
+    wall_set(i, alarm);
+}
+
+int wall_push(alarm_t *alarm) {
+    alarm_t **items;
+
+    if (wall_count == wall_size) {
+        items = realloc(wall_alarms, (wall_size ? wall_size * 2 : 64) * sizeof(alarm_t *));
+        if (items == NULL)
+            return -1;
+        wall_alarms = items;
+        wall_size = wall_size ? wall_size * 2 : 64;
+    }
+    wall_alarms[wall_count] = alarm;
+    wall_sift(wall_count++);
+    return 0;
+}
+
+void wall_remove(alarm_t *alarm) {
+    int i = alarm->wall_index;
+
+    alarm->wall_index = -1;
+    if (--wall_count > i) {
+        wall_alarms[i] = wall_alarms[wall_count];
+        wall_sift(i);
+    }
+}
+
+/*
+ * Take a listed alarm out of whichever structure it waits in: its
+ * pending store, the wall clock heap, or none if it is paused.
+ */
+static inline void store_detach(alarm_t *alarm) {
+    if (alarm->paused)
+        return;
+    if (alarm->wall_index >= 0)
+        wall_remove(alarm);
+    else
+        store_remove(&alarm_stores[alarm->priority], alarm);
+}
+
+/*
+ * Command latency (entry to processInput until the command has been
+ * applied) as a log2 histogram of microseconds.
+ */
+#define LATENCY_BUCKETS         32
+
+atomic_ulong command_latency[LATENCY_BUCKETS];
+
+/*
+ * Event counters. Each thread increments its own cache-line aligned
+ * block, so counting never bounces a shared line between the main,
+ * alarm and display threads; the Stats command sums the blocks on
+ * demand. A block is only ever written by the thread that owns it,
+ * so a relaxed load and store is enough. When a thread exits (display
+ * threads are cancelled) its block is handed to the next new thread
+ * and keeps its counts, so the totals never go backwards.
+ */
+#define CACHE_LINE              64
+
+typedef struct alarm_stats {
+    atomic_ulong        inserts;
+    atomic_ulong        cancels;
+    atomic_ulong        replaces;
+    atomic_ulong        fires;
+    atomic_ulong        display_lines;
+    atomic_ulong        unknown_commands;
+    atomic_int          in_use;
+    struct alarm_stats  *next;
+} __attribute__((aligned(CACHE_LINE))) alarm_stats_t;
+
+_Atomic(alarm_stats_t *) stats_blocks = NULL;
+static __thread alarm_stats_t *thread_stats = NULL;
+pthread_key_t stats_key;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void stats_release(void *arg) {
+    atomic_store(&((alarm_stats_t *)arg)->in_use, 0);
+}
+
+static void stats_init(void) {
+    int status = pthread_key_create(&stats_key, stats_release);
+
+    if (status != 0)
+        err_abort(status, "Create stats key");
+}
+
+static alarm_stats_t *stats_self(void) {
+    alarm_stats_t *block;
+    int unused;
+
+    if (thread_stats != NULL)
+        return thread_stats;
+    pthread_once(&stats_once, stats_init);
+    for (block = atomic_load(&stats_blocks); block != NULL; block = block->next) {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&block->in_use, &unused, 1))
+            break;
+    }
+    if (block == NULL) {
+        block = aligned_alloc(CACHE_LINE, sizeof(alarm_stats_t));
+        if (block == NULL)
+            errno_abort("Allocate stats block");
+        memset(block, 0, sizeof(alarm_stats_t));
+        atomic_store(&block->in_use, 1);
+        block->next = atomic_load(&stats_blocks);
+        while (!atomic_compare_exchange_weak(&stats_blocks, &block->next, block))
+            ;
+    }
+    pthread_setspecific(stats_key, block);
+    thread_stats = block;
+    return block;
+}
+
+/*
+ * Gauges and histograms for the metrics endpoint. They are plain
+ * atomics written where the events happen, so the metrics thread can
+ * render them without ever taking alarm_mutex.
+ */
+atomic_int pending_alarms;
+atomic_int display_thread_count;
+atomic_ulong fire_lateness[LATENCY_BUCKETS];    /* log2 usec */
+atomic_ulong fire_lateness_sum;                 /* usec */
+atomic_ulong lock_wait[LATENCY_BUCKETS];        /* log2 usec */
+atomic_ulong lock_wait_sum;                     /* usec */
+
+static inline int latency_bucket(long usec) {
+    int bucket = 0;
+
+    while (usec > 1 && bucket < LATENCY_BUCKETS - 1) {
+        usec >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/*
+ * Every value in bucket b is below this many usec, except in the last
+ * bucket, which takes everything too large for the others.
+ */
+static inline unsigned long latency_bound(int bucket) {
+    return 2UL << bucket;
+}
+
+static void histogram_add(atomic_ulong *histogram, atomic_ulong *sum, long usec) {
+    atomic_fetch_add_explicit(&histogram[latency_bucket(usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(sum, usec, memory_order_relaxed);
+}
+
+/*
+ * Lock alarm_mutex, recording how long the caller waited. The
+ * uncontended case is a trylock and costs no clock reads.
+ */
+int alarm_lock(void) {
+    struct timespec start, end;
+    int status;
+
+    status = pthread_mutex_trylock(&alarm_mutex);
+    if (status != EBUSY) {
+        if (status == 0)
+            atomic_fetch_add_explicit(&lock_wait[0], 1, memory_order_relaxed);
+        return status;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = pthread_mutex_lock(&alarm_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    histogram_add(lock_wait, &lock_wait_sum,
+                  (end.tv_sec - start.tv_sec) * 1000000L
+                  + (end.tv_nsec - start.tv_nsec) / 1000);
+    return status;
+}
+
+/*
+ * Alarms per Alarm_Time_Group_Number, in an open-addressed table
+ * written only under alarm_mutex and read lock-free by the metrics
+ * thread. It also makes has_alarms_in_group O(1). A group whose count
+ * drops to zero leaves a deleted marker, which the next new group on
+ * its probe path reuses, and once a quarter of the table is markers
+ * it is rebuilt in place, so groups that come and go over hours do
+ * not use it up. Groups that find no room while it is full of live
+ * ones are counted in group_untracked and fall back to a list scan.
+ * A scrape that races a rebuild may miss some groups.
+ */
+#define GROUP_TABLE_SIZE        4096
+#define GROUP_EMPTY             0
+#define GROUP_LIVE              1
+#define GROUP_DELETED           2
+
+typedef struct group_count {
+    atomic_int          used;           /* GROUP_EMPTY, _LIVE or _DELETED */
+    atomic_int          group;
+    atomic_int          count;
+} group_count_t;
+
+group_count_t group_counts[GROUP_TABLE_SIZE];
+int group_deleted = 0;
+atomic_int group_untracked;
+
+static inline unsigned int group_hash(int group_number) {
+    return ((unsigned int)group_number * 2654435761u) & (GROUP_TABLE_SIZE - 1);
+}
+
+// Drop the deleted markers by putting the live groups back afresh
+static void group_rebuild(void) {
+    static struct { int group, count; } live[GROUP_TABLE_SIZE];
+    unsigned int j;
+    int i, n = 0;
+
+    for (i = 0; i < GROUP_TABLE_SIZE; i++) {
+        if (atomic_load_explicit(&group_counts[i].used, memory_order_relaxed) == GROUP_LIVE) {
+            live[n].group = atomic_load_explicit(&group_counts[i].group, memory_order_relaxed);
+            live[n++].count = atomic_load_explicit(&group_counts[i].count, memory_order_relaxed);
+        }
+        atomic_store_explicit(&group_counts[i].used, GROUP_EMPTY, memory_order_relaxed);
+        atomic_store_explicit(&group_counts[i].count, 0, memory_order_relaxed);
+    }
+    for (i = 0; i < n; i++) {
+        for (j = group_hash(live[i].group);
+             atomic_load_explicit(&group_counts[j].used, memory_order_relaxed) != GROUP_EMPTY;
+             j = (j + 1) & (GROUP_TABLE_SIZE - 1))
+            ;
+        atomic_store_explicit(&group_counts[j].group, live[i].group, memory_order_relaxed);
+        atomic_store_explicit(&group_counts[j].count, live[i].count, memory_order_relaxed);
+        atomic_store_explicit(&group_counts[j].used, GROUP_LIVE, memory_order_release);
+    }
+    group_deleted = 0;
+}
+
+group_count_t *group_slot(int group_number, int create) {
+    unsigned int i;
+    group_count_t *slot = NULL, *reuse = NULL;
+    int probes, used;
+
+    if (create && group_deleted >= GROUP_TABLE_SIZE / 4)
+        group_rebuild();
+    i = group_hash(group_number);
+    for (probes = 0; probes < GROUP_TABLE_SIZE; probes++) {
+        slot = &group_counts[i];
+        used = atomic_load_explicit(&slot->used, memory_order_acquire);
+        if (used == GROUP_EMPTY)
+            break;
+        if (used == GROUP_DELETED) {
+            if (reuse == NULL)
+                reuse = slot;
+        } else if (atomic_load_explicit(&slot->group, memory_order_relaxed) == group_number) {
+            return slot;
+        }
+        i = (i + 1) & (GROUP_TABLE_SIZE - 1);
+    }
+    if (!create)
+        return NULL;
+    if (reuse != NULL)
+        group_deleted--;
+    else if (probes < GROUP_TABLE_SIZE)
+        reuse = slot;
+    else
+        return NULL;
+    atomic_store_explicit(&reuse->group, group_number, memory_order_relaxed);
+    atomic_store_explicit(&reuse->used, GROUP_LIVE, memory_order_release);
+    return reuse;
+}
+
+void group_adjust(int group_number, int delta) {
+    group_count_t *slot = group_slot(group_number, delta > 0);
+    int count;
+
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&group_untracked, delta, memory_order_relaxed);
+        return;
+    }
+    count = atomic_load_explicit(&slot->count, memory_order_relaxed) + delta;
+    atomic_store_explicit(&slot->count, count, memory_order_relaxed);
+    if (count == 0) {
+        atomic_store_explicit(&slot->used, GROUP_DELETED, memory_order_release);
+        group_deleted++;
+    }
+}
+
+#define STAT_INC(field) do { \
+    alarm_stats_t *_stats = stats_self(); \
+    atomic_store_explicit(&_stats->field, \
+        atomic_load_explicit(&_stats->field, memory_order_relaxed) + 1, \
+        memory_order_relaxed); \
+    } while (0)
+
+/*
+ * Lifecycle trace. A record is written by the thread that saw the
+ * event into its own ring, so tracing takes no locks; the dump reads
+ * the rings while they are live and may catch a record mid-write.
+ */
+enum trace_event {
+    TRACE_COMMAND_BEGIN = 1,    /* processInput entered */
+    TRACE_COMMAND_END,          /* command applied */
+    TRACE_PARSE,                /* Start/Replace/Upsert parsed, arg = seconds */
+    TRACE_INSERT,               /* on alarm_list, arg = group */
+    TRACE_GROUP,                /* check_and_insert, arg = 1 if it created the display thread */
+    TRACE_DISPLAY,              /* display tick printed the alarm, arg = group */
+    TRACE_EXPIRE,               /* detached for firing, arg = group */
+    TRACE_FIRE,                 /* printed or hook called */
+    TRACE_FREE,                 /* fired alarm freed */
+    TRACE_CANCEL,               /* cancelled and freed */
+    TRACE_REPLACE,              /* replaced or upserted, arg = seconds */
+    TRACE_EVENTS
+};
+
+static const char *trace_names[TRACE_EVENTS] = {
+    "", "command", "command", "parse", "insert", "group", "display",
+    "expire", "fire", "free", "cancel", "replace"
+};
+
+typedef struct trace_record {
+    uint64_t            ns;             /* CLOCK_MONOTONIC */
+    uint32_t            tid;
+    uint16_t            event;
+    uint16_t            unused;
+    int32_t             id;
+    int32_t             arg;
+} trace_record_t;
+
+#define TRACE_MAGIC             0x43525441u     /* "ATRC" */
+#define TRACE_RING_SIZE         65536           /* records, power of two */
+
+#ifdef ALARM_TRACE
+
+/*
+ * Rings are handed back when their thread exits and reused by the
+ * next thread that traces, the same way as the stats blocks, so
+ * display threads coming and going with their groups do not each
+ * leave a ring behind. A reused ring keeps its older records until
+ * they are overwritten; each record carries its own tid.
+ */
+typedef struct trace_ring {
+    trace_record_t      records[TRACE_RING_SIZE];
+    atomic_ulong        head;
+    uint32_t            tid;
+    atomic_int          in_use;
+    struct trace_ring   *next;
+} trace_ring_t;
+
+_Atomic(trace_ring_t *) trace_rings = NULL;
+static __thread trace_ring_t *thread_ring = NULL;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void trace_release(void *arg) {
+    atomic_store(&((trace_ring_t *)arg)->in_use, 0);
+}
+
+static void trace_init(void) {
+    int status = pthread_key_create(&trace_key, trace_release);
+
+    if (status != 0)
+        err_abort(status, "Create trace key");
+}
+
+static void trace_record(int event, int id, int arg) {
+    trace_ring_t *ring = thread_ring;
+    trace_record_t *record;
+    struct timespec now;
+    unsigned long head;
+    int unused;
+
+    if (ring == NULL) {
+        pthread_once(&trace_once, trace_init);
+        for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+            unused = 0;
+            if (atomic_compare_exchange_strong(&ring->in_use, &unused, 1))
+                break;
+        }
+        if (ring == NULL) {
+            ring = calloc(1, sizeof(trace_ring_t));
+            if (ring == NULL)
+                return;
+            atomic_store(&ring->in_use, 1);
+            ring->next = atomic_load(&trace_rings);
+            while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+                ;
+        }
+        ring->tid = (uint32_t)syscall(SYS_gettid);
+        pthread_setspecific(trace_key, ring);
+        thread_ring = ring;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    record->tid = ring->tid;
+    record->event = event;
+    record->id = id;
+    record->arg = arg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define TRACE(event, id, arg)   trace_record(event, id, arg)
+
+/*
+ * Write every ring's surviving records to path: a magic word, the
+ * record count, then the records, oldest first within each thread.
+ */
+void trace_dump(const char *path) {
+    unsigned long head, first, i;
+    uint32_t header[2] = { TRACE_MAGIC, 0 };
+    FILE *out;
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        return;
+    }
+    fwrite(header, sizeof(header), 1, out);
+    for (trace_ring_t *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (i = first; i < head; i++)
+            fwrite(&ring->records[i & (TRACE_RING_SIZE - 1)], sizeof(trace_record_t), 1, out);
+        header[1] += head - first;
+    }
+    fseek(out, 0, SEEK_SET);
+    fwrite(header, sizeof(header), 1, out);
+    fclose(out);
+    printf("Wrote %u trace records to %s\n", header[1], path);
+}
+
+#else
+
+#define TRACE(event, id, arg)   do { } while (0)
+
+void trace_dump(const char *path) {
+    fprintf(stderr, "Tracing not compiled in (build with -DALARM_TRACE)\n");
+}
+
+#endif
+
+/*
+ * Convert a trace dump to Chrome trace event JSON on stdout: every
+ * record becomes an instant event on its thread, commands become
+ * duration events, and each alarm gets an async span from insert to
+ * free or cancel so its whole life shows as one bar.
+ */
+int trace_to_chrome(const char *path) {
+    trace_record_t record;
+    uint32_t header[2];
+    FILE *in;
+    int first = 1;
+
+    in = fopen(path, "rb");
+    if (in == NULL || fread(header, sizeof(header), 1, in) != 1 || header[0] != TRACE_MAGIC) {
+        fprintf(stderr, "%s is not an alarm trace\n", path);
+        if (in != NULL)
+            fclose(in);
+        return 1;
+    }
+    printf("{\"traceEvents\":[\n");
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.event == 0 || record.event >= TRACE_EVENTS)
+            continue;
+        printf("%s{\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,",
+               first ? "" : ",\n", trace_names[record.event], record.tid, record.ns / 1000.0);
+        first = 0;
+        switch (record.event) {
+        case TRACE_COMMAND_BEGIN:
+            printf("\"ph\":\"B\"}");
+            continue;
+        case TRACE_COMMAND_END:
+            printf("\"ph\":\"E\"}");
+            continue;
+        default:
+            printf("\"ph\":\"i\",\"s\":\"t\",\"args\":{\"id\":%d,\"arg\":%d}}",
+                   record.id, record.arg);
+        }
+        if (record.event == TRACE_INSERT || record.event == TRACE_FREE || record.event == TRACE_CANCEL)
+            printf(",\n{\"name\":\"alarm %d\",\"cat\":\"alarm\",\"ph\":\"%s\",\"id\":%d,"
+                   "\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                   record.id, record.event == TRACE_INSERT ? "b" : "e", record.id,
+                   record.tid, record.ns / 1000.0);
+    }
+    printf("\n]}\n");
+    fclose(in);
+    return 0;
+}
+
+/*
+ * Expiry event stream. With --events FILE (or ALARM_EVENTS_FILE) every
+ * fired alarm and every display line is also published into a ring
+ * of fixed-size records in FILE, mapped shared, typically under
+ * /dev/shm. Publishers in this process take event_mutex, so the ring
+ * has a single writer at a time; readers in other processes never
+ * write to it and make no system calls while events are flowing.
+ * Event n lives in slot n % EVENT_RING_SIZE, whose seq is 0 while it
+ * is being written and n + 1 once it is complete. A reader that finds
+ * head more than a ring ahead of it, or a slot's seq changed under
+ * it, knows exactly how many events it lost.
+ * "alarm_mutex --subscribe FILE" is such a reader.
+ */
+#define EVENT_MAGIC             0x414c4556u     /* "ALEV" */
+#define EVENT_RING_SIZE         4096
+
+enum alarm_event_type {
+    EVENT_EXPIRE,
+    EVENT_DISPLAY
+};
+
+typedef struct alarm_event {
+    _Atomic uint64_t    seq;
+    uint64_t            ns;             /* CLOCK_REALTIME */
+    int64_t             time;           /* the alarm's deadline */
+    int32_t             type;
+    int32_t             id;
+    int32_t             group;
+    int32_t             seconds;
+    char                message[96];
+} alarm_event_t;
+
+typedef struct event_ring {
+    uint32_t            magic;
+    uint32_t            size;
+    _Atomic uint64_t    head;           /* events published so far */
+    char                pad[CACHE_LINE - 16];
+    alarm_event_t       events[EVENT_RING_SIZE];
+} event_ring_t;
+
+event_ring_t *event_ring = NULL;
+pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void event_open(const char *path) {
+    int fd;
+
+    if (event_ring != NULL)
+        munmap(event_ring, sizeof(event_ring_t));
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort("Open event ring");
+    if (ftruncate(fd, sizeof(event_ring_t)) != 0)
+        errno_abort("Size event ring");
+    event_ring = mmap(NULL, sizeof(event_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (event_ring == MAP_FAILED)
+        errno_abort("Map event ring");
+    close(fd);
+    event_ring->size = EVENT_RING_SIZE;
+    atomic_store(&event_ring->head, 0);
+    atomic_thread_fence(memory_order_release);
+    event_ring->magic = EVENT_MAGIC;
+}
+
+void event_publish(int type, alarm_t *alarm, int group) {
+    alarm_event_t *event;
+    struct timespec now;
+    uint64_t n;
+
+    if (event_ring == NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&event_mutex);
+    n = atomic_load_explicit(&event_ring->head, memory_order_relaxed);
+    event = &event_ring->events[n % EVENT_RING_SIZE];
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    // A displayed alarm is still pending, so its shift is not folded in
+    // yet, and if it is waiting on the wall clock its time is already
+    // seconds from EPOCH
+    if (type == EVENT_DISPLAY && alarm->wall_index >= 0)
+        event->time = alarm->time;
+    else if (type == EVENT_DISPLAY)
+        event->time = deadline_wall(alarm->time + alarm_shift);
+    else
+        event->time = deadline_wall(alarm->time);
+    event->type = type;
+    event->id = alarm->id;
+    event->group = group;
+    event->seconds = alarm->seconds;
+    memcpy(event->message, alarm->message, sizeof(event->message) - 1);
+    event->message[sizeof(event->message) - 1] = '\0';
+    atomic_store_explicit(&event->seq, n + 1, memory_order_release);
+    atomic_store_explicit(&event_ring->head, n + 1, memory_order_release);
+    pthread_mutex_unlock(&event_mutex);
+}
+
+/*
+ * Follow the ring in FILE from its current head, printing each event
+ * and reporting any that were overwritten before they could be read.
+ */
+int event_subscribe(const char *path) {
+    const event_ring_t *ring;
+    alarm_event_t event;
+    struct timespec idle = { 0, 1000000 };
+    uint64_t next, head, lost = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        errno_abort("Open event ring");
+    ring = mmap(NULL, sizeof(event_ring_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        errno_abort("Map event ring");
+    close(fd);
+    if (ring->magic != EVENT_MAGIC || ring->size != EVENT_RING_SIZE) {
+        fprintf(stderr, "%s is not an alarm event ring\n", path);
+        return 1;
+    }
+    next = atomic_load_explicit((_Atomic uint64_t *)&ring->head, memory_order_acquire);
+    while (1) {
+        head = atomic_load_explicit((_Atomic uint64_t *)&ring->head, memory_order_acquire);
+        if (next == head) {
+            fflush(stdout);
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        if (head - next > EVENT_RING_SIZE) {
+            lost += head - EVENT_RING_SIZE - next;
+            printf("Overrun: lost %lu events (%lu in total)\n",
+                   (unsigned long)(head - EVENT_RING_SIZE - next), (unsigned long)lost);
+            next = head - EVENT_RING_SIZE;
+        }
+        // Copy the slot out, then check it was not reused meanwhile
+        const alarm_event_t *slot = &ring->events[next % EVENT_RING_SIZE];
+        if (atomic_load_explicit((_Atomic uint64_t *)&slot->seq, memory_order_acquire) != next + 1)
+            continue;
+        memcpy((char *)&event + sizeof(event.seq), (const char *)slot + sizeof(slot->seq),
+               sizeof(event) - sizeof(event.seq));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit((_Atomic uint64_t *)&slot->seq, memory_order_relaxed) != next + 1)
+            continue;
+        printf("%lu %s Alarm(%d) group %d due %ld at %lu.%09lu: %s\n",
+               (unsigned long)next, event.type == EVENT_EXPIRE ? "expire" : "display",
+               event.id, event.group, (long)event.time,
+               (unsigned long)(event.ns / 1000000000ULL), (unsigned long)(event.ns % 1000000000ULL),
+               event.message);
+        next++;
+    }
+}
+
+typedef struct display_thread {
+    pthread_t thread_id;
+    int time_group_number;
+    int in_use;     /* group 0 is a real group, so it cannot mark free slots */
+} display_t;
+
+display_t display_threads[100];
+pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* display_alarm_thread(void *arg) {
+    int group_number = *(int*)arg;  // Set the group number from the passed argument
+    free(arg);  // Free the dynamically allocated memory for group number
+
+    time_t current_time;
+    pthread_cleanup_push(clock_leave, NULL);
+    while (1) {
+        // printf is a cancellation point: never die holding alarm_mutex
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        alarm_lock();
+        for (alarm_t *alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
+            if (alarm->Alarm_Time_Group_Number == group_number && !alarm->paused) {
+                current_time = alarm_now();
+                printf("Alarm (%d) Printed by Alarm Thread %lu for Alarm_Time_Group_Number %d at %ld: %s\n",
+                       alarm->id,
+                       (unsigned long)pthread_self(),
+                       group_number,
+                       current_time,
+                       alarm->message);
+                STAT_INC(display_lines);
+                TRACE(TRACE_DISPLAY, alarm->id, group_number);
+                event_publish(EVENT_DISPLAY, alarm, group_number);
+            }
+        }
+        pthread_mutex_unlock(&alarm_mutex);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        clock_sleep(1);
+    }
+    pthread_cleanup_pop(0);
+    return NULL;
+}
+
+/*
+ * Unlink an alarm from the doubly linked list in O(1) and retire its
+ * handle.
+ */
+void remove_alarm(alarm_t **head, alarm_t *alarm) {
+    if (alarm->prev != NULL) {
+        alarm->prev->link = alarm->link;
+    } else if (*head == alarm) {
+        *head = alarm->link;
+    } else {
+        return;
+    }
+    if (alarm->link != NULL) {
+        alarm->link->prev = alarm->prev;
+    }
+    alarm->link = alarm->prev = NULL;
+    id_index_remove(alarm);
+    slot_release(alarm);
+    group_adjust(alarm->Alarm_Time_Group_Number, -1);
+    atomic_fetch_sub(&pending_alarms, 1);
+}
+
+/*
+ * Make sure the group of the alarm with this id has a display thread.
+ * Called after the alarm was inserted and alarm_mutex dropped, so it
+ * looks the alarm up again: by now it may already have fired or been
+ * cancelled, in which case there is nothing to do.
+ */
+void check_and_insert(int alarm_id) {
+    alarm_t *alarm;
+    int found = 0, status;
+    int group_number;
+
+    alarm_lock();
+    pthread_mutex_lock(&display_mutex);
+    alarm = find(alarm_id);
+    if (alarm == NULL)
+        found = 1;
+    else
+        TRACE(TRACE_GROUP, alarm->id, 0);
+    for (int i = 0; !found && i < 100; i++) {
+        if (display_threads[i].in_use
+            && display_threads[i].time_group_number == alarm->Alarm_Time_Group_Number) {
+            
+            // A display thread for this group already exists
+            found = 1;
+            break;
+        }
+    }
+
+    if (!found) {
+
+        // Create a new display thread for this group
+        for (int i = 0; i < 100; i++) {
+        if (!display_threads[i].in_use) {
+            int *group_number_ptr = malloc(sizeof(int));
+            if (group_number_ptr == NULL) {
+                fprintf(stderr, "Memory allocation failed for group_number_ptr\n");
+                break; // or handle the error appropriately
+            }
+            // The new thread owns (and frees) group_number_ptr
+            group_number = alarm->Alarm_Time_Group_Number;
+            *group_number_ptr = group_number;
+
+            // Create the thread
+            clock_join();
+            status = pthread_create(&display_threads[i].thread_id, NULL, display_alarm_thread, group_number_ptr);
+            if (status != 0) {
+                fprintf(stderr, "Create display thread: %s\n", strerror(status));
+                clock_leave(NULL);
+                free(group_number_ptr);
+                break;
+            }
+            pthread_detach(display_threads[i].thread_id);
+            display_threads[i].time_group_number = group_number;
+            display_threads[i].in_use = 1;
+            atomic_fetch_add(&display_thread_count, 1);
+            TRACE(TRACE_GROUP, alarm->id, 1);
+            
+            printf("Created New Display Alarm Thread %p for Alarm_Time_Group_Number %d to Display Alarm(%d) at %ld: %s\n",
+                (void*)display_threads[i].thread_id, 
+                group_number, 
+                alarm->id, 
+                alarm_now(), 
+                alarm->message);
+            break;
+    }
+}
+    }
+    pthread_mutex_unlock(&display_mutex);
+    pthread_mutex_unlock(&alarm_mutex);
+}
+
+
+/*
+ * The alarm thread's start routine.
+ */
+void terminate_display_thread_for_group(int group_number) {
+    // Implementation depends on how you manage threads
+    // Example:
+    for (int i = 0; i < 100; i++) {
+        if (display_threads[i].in_use && display_threads[i].time_group_number == group_number) {
+            pthread_cancel(display_threads[i].thread_id); // Cancel the thread
+            display_threads[i].in_use = 0;    // Mark as unused
+            atomic_fetch_sub(&display_thread_count, 1);
+            // Additional cleanup if necessary
+            break;
+        }
+    }
+}
+
+/*
+ * Flat combining (Hendler, Incze, Shavit and Tzafrir). With
+ * --combining, insert_alarm, cancel_alarm and replace_alarm do not
+ * queue on alarm_mutex: each thread posts its operation in its own
+ * cache-line record and spins on it, and whichever thread gets the
+ * mutex applies every posted operation in one pass before releasing
+ * it. Under contention the lists, indexes and stores then stay in one
+ * core's cache instead of moving with the lock. Records are reused
+ * across threads the same way as the stats blocks.
+ */
+enum combine_op {
+    COMBINE_NONE,
+    COMBINE_INSERT,
+    COMBINE_CANCEL,
+    COMBINE_REPLACE
+};
+
+typedef struct combine_record {
+    atomic_int          op;             /* COMBINE_NONE once applied */
+    alarm_t             *alarm;
+    int                 id;
+    unsigned long       handle;
+    int                 result;
+    atomic_int          in_use;
+    struct combine_record *next;
+} __attribute__((aligned(CACHE_LINE))) combine_record_t;
+
+int flat_combining = 0;
+_Atomic(combine_record_t *) combine_records = NULL;
+static __thread combine_record_t *thread_combine = NULL;
+pthread_key_t combine_key;
+pthread_once_t combine_once = PTHREAD_ONCE_INIT;
+
+int insert_alarm_locked(alarm_t *alarm);
+int replace_alarm_locked(int alarm_id, unsigned long handle, alarm_t *newAlarm);
+int cancel_alarm_locked(int alarm_id, unsigned long handle);
+
+static void combine_release(void *arg) {
+    atomic_store(&((combine_record_t *)arg)->in_use, 0);
+}
+
+static void combine_init(void) {
+    int status = pthread_key_create(&combine_key, combine_release);
+
+    if (status != 0)
+        err_abort(status, "Create combining key");
+}
+
+static combine_record_t *combine_self(void) {
+    combine_record_t *record;
+    int unused;
+
+    if (thread_combine != NULL)
+        return thread_combine;
+    pthread_once(&combine_once, combine_init);
+    for (record = atomic_load(&combine_records); record != NULL; record = record->next) {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &unused, 1))
+            break;
+    }
+    if (record == NULL) {
+        record = aligned_alloc(CACHE_LINE, sizeof(combine_record_t));
+        if (record == NULL)
+            errno_abort("Allocate combining record");
+        memset(record, 0, sizeof(combine_record_t));
+        atomic_store(&record->in_use, 1);
+        record->next = atomic_load(&combine_records);
+        while (!atomic_compare_exchange_weak(&combine_records, &record->next, record))
+            ;
+    }
+    pthread_setspecific(combine_key, record);
+    thread_combine = record;
+    return record;
+}
+
+// Apply every posted operation. Requires alarm_mutex.
+static void combine_pass(void) {
+    combine_record_t *record;
+
+    for (record = atomic_load(&combine_records); record != NULL; record = record->next) {
+        switch (atomic_load(&record->op)) {
+        case COMBINE_INSERT:
+            record->result = insert_alarm_locked(record->alarm);
+            break;
+        case COMBINE_CANCEL:
+            record->result = cancel_alarm_locked(record->id, record->handle);
+            break;
+        case COMBINE_REPLACE:
+            record->result = replace_alarm_locked(record->id, record->handle, record->alarm);
+            if (record->result == 0)
+                record->id = record->alarm->id;
+            break;
+        default:
+            continue;
+        }
+        atomic_store(&record->op, COMBINE_NONE);
+    }
+}
+
+/*
+ * Post an operation and wait until it has been applied, combining
+ * everyone's whenever the mutex is free. Returns the operation's
+ * result; for a replace the record's id is the id replaced.
+ */
+int combine(int op, alarm_t *alarm, int alarm_id, unsigned long handle) {
+    combine_record_t *record = combine_self();
+    int status;
+
+    record->alarm = alarm;
+    record->id = alarm_id;
+    record->handle = handle;
+    atomic_store(&record->op, op);
+    while (atomic_load(&record->op) != COMBINE_NONE) {
+        if (pthread_mutex_trylock(&alarm_mutex) == 0) {
+            combine_pass();
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+        } else {
+            sched_yield();
+        }
+    }
+    return record->result;
+}
+
+/*
+ * Insert a new alarm; insert_alarm_locked expects alarm_mutex to be
+ * held. Ids are unique: returns -1, leaving the alarm untouched for
+ * the caller to free, if one with the same id is already pending.
+ */
+int insert_alarm_locked(alarm_t *alarm) {
+    alarm_t **last, *next, *prev = NULL;
+    int status;
+
+    if (find(alarm->id) != NULL) {
+        fprintf(stderr, "Alarm ID %d already exists\n", alarm->id);
+        return -1;
+    }
+
+    alarm->time = alarm_clock() + alarm->seconds - alarm_shift;  // Set the absolute time for the alarm
+    alarm->paused = 0;
+    alarm->wall_index = -1;
+
+    // Start at the head of the list
+    last = &alarm_list;
+    next = *last;
+
+    // Iterate to find the insertion point
+    while (next != NULL && next->id < alarm->id) {
+        prev = next;
+        last = &next->link;
+        next = next->link;
+    }
+
+    // Get the current time for the insert_time
+    time_t insert_time = alarm_now();
+
+    // Get the thread ID for the main thread
+    pthread_t thread_id = pthread_self();
+    printf("Alarm(%d) Inserted by Main Thread %lu Into Alarm List at %ld: %s\n",
+           alarm->id, 
+           (unsigned long)thread_id, 
+           insert_time, 
+           alarm->message);
+    // printf("Current head of list: %p\n", (void *)alarm_list);
+    // Insert the new alarm in the list
+    alarm->link = next;
+    alarm->prev = prev;
+    if (next != NULL)
+        next->prev = alarm;
+    *last = alarm;
+    slot_acquire(alarm);
+    id_index_insert(alarm);
+    TRACE(TRACE_INSERT, alarm->id, alarm->Alarm_Time_Group_Number);
+    group_adjust(alarm->Alarm_Time_Group_Number, 1);
+    atomic_fetch_add(&pending_alarms, 1);
+    printf("Alarm(%d) Handle @%lx\n", alarm->id, alarm_handle(alarm));
+
+    // Queue it for firing and wake the alarm thread in case it is now
+    // the earliest deadline
+    store_push(&alarm_stores[alarm->priority], alarm);
+    clock_kick();
+    status = pthread_cond_signal(&alarm_cond);
+    if (status != 0)
+        err_abort(status, "Signal cond");
+    // printf("New head of list: %p\n", (void *)alarm_list);
+    STAT_INC(inserts);
+    return 0;
+}
+
+int insert_alarm(alarm_t *alarm) {
+    int status, result;
+
+    if (flat_combining)
+        return combine(COMBINE_INSERT, alarm, alarm->id, 0);
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    result = insert_alarm_locked(alarm);
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+}
+
+int has_alarms_in_group(int group_number) {
+    group_count_t *slot = group_slot(group_number, 0);
+    alarm_t *current = alarm_list;
+
+    if (slot != NULL && atomic_load_explicit(&slot->count, memory_order_relaxed) > 0)
+        return 1;
+    if (atomic_load_explicit(&group_untracked, memory_order_relaxed) == 0)
+        return 0;
+    while (current != NULL) {
+        if (current->Alarm_Time_Group_Number == group_number) {
+            return 1; // Alarm found in the group
+        }
+        current = current->link;
+    }
+    return 0; // No alarms found in the group
+}
+
+/*
+ * Pick the alarm to dispatch next: the head of the most urgent
+ * priority heap whose head has expired. Returns NULL if nothing is
+ * due, and stores the earliest pending deadline in *next_time (0 if
+ * there are no alarms at all).
+ */
+alarm_t *next_expired_alarm(time_t now, time_t *next_time) {
+    alarm_t *top;
+    int p;
+
+    *next_time = 0;
+    for (p = 0; p < ALARM_PRIORITIES; p++) {
+        top = store_top(&alarm_stores[p]);
+        if (top == NULL)
+            continue;
+        if (top->time + alarm_shift <= now)
+            return top;
+        if (*next_time == 0 || top->time + alarm_shift < *next_time)
+            *next_time = top->time + alarm_shift;
+    }
+    return NULL;
+}
+
+static long usec_since(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int firing_batch_contains(int alarm_id) {
+    int i;
+
+    for (i = 0; i < firing_count; i++)
+        if (firing_batch[i]->id == alarm_id)
+            return 1;
+    return 0;
+}
+
+/*
+ * Relaxed MultiQueue (Rihani, Sanders and Dementiev). Several binary
+ * heaps, each behind its own lock; push goes to a random heap, pop
+ * peeks at the tops of two random heaps and takes the earlier. Pops
+ * come out close to, but not exactly in, deadline order, and many
+ * threads can pop at once without sharing a lock.
+ */
+typedef struct mq_heap {
+    pthread_mutex_t     lock;
+    alarm_t             **items;
+    int                 count, size;
+    atomic_long         top;            /* deadline of items[0], or LONG_MAX */
+} __attribute__((aligned(CACHE_LINE))) mq_heap_t;
+
+typedef struct multiqueue {
+    mq_heap_t           *heaps;
+    int                 nheaps;
+    atomic_int          count;
+} multiqueue_t;
+
+void mq_init(multiqueue_t *mq, int nheaps) {
+    int i;
+
+    mq->heaps = (mq_heap_t *)aligned_alloc(CACHE_LINE, nheaps * sizeof(mq_heap_t));
+    if (mq->heaps == NULL)
+        errno_abort("Allocate multiqueue");
+    for (i = 0; i < nheaps; i++) {
+        pthread_mutex_init(&mq->heaps[i].lock, NULL);
+        mq->heaps[i].items = NULL;
+        mq->heaps[i].count = mq->heaps[i].size = 0;
+        atomic_init(&mq->heaps[i].top, LONG_MAX);
+    }
+    mq->nheaps = nheaps;
+    atomic_init(&mq->count, 0);
+}
+
+void mq_destroy(multiqueue_t *mq) {
+    int i;
+
+    for (i = 0; i < mq->nheaps; i++) {
+        pthread_mutex_destroy(&mq->heaps[i].lock);
+        free(mq->heaps[i].items);
+    }
+    free(mq->heaps);
+}
+
+void mq_push(multiqueue_t *mq, alarm_t *alarm) {
+    mq_heap_t *heap;
+    alarm_t **items;
+    int i, parent;
+
+    // Any heap will do, so skip ones that are busy
+    do
+        heap = &mq->heaps[thread_random() % mq->nheaps];
+    while (pthread_mutex_trylock(&heap->lock) != 0);
+    if (heap->count == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 64;
+        items = realloc(heap->items, heap->size * sizeof(alarm_t *));
+        if (items == NULL)
+            errno_abort("Grow multiqueue heap");
+        heap->items = items;
+    }
+    for (i = heap->count++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!store_before(alarm, heap->items[parent]))
+            break;
+        heap->items[i] = heap->items[parent];
+    }
+    heap->items[i] = alarm;
+    atomic_store(&heap->top, heap->items[0]->time);
+    atomic_fetch_add(&mq->count, 1);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Pop from the earlier of two random heaps. Returns NULL once the
+ * whole queue is empty.
+ */
+alarm_t *mq_pop(multiqueue_t *mq) {
+    mq_heap_t *heap, *other;
+    alarm_t *alarm, *last;
+    int i, child;
+
+    while (atomic_load(&mq->count) > 0) {
+        heap = &mq->heaps[thread_random() % mq->nheaps];
+        other = &mq->heaps[thread_random() % mq->nheaps];
+        if (atomic_load(&other->top) < atomic_load(&heap->top))
+            heap = other;
+        if (atomic_load(&heap->top) == LONG_MAX)
+            continue;
+        pthread_mutex_lock(&heap->lock);
+        if (heap->count == 0) {
+            pthread_mutex_unlock(&heap->lock);
+            continue;
+        }
+        alarm = heap->items[0];
+        last = heap->items[--heap->count];
+        for (i = 0; (child = 2 * i + 1) < heap->count; i = child) {
+            if (child + 1 < heap->count
+                && store_before(heap->items[child + 1], heap->items[child]))
+                child++;
+            if (!store_before(heap->items[child], last))
+                break;
+            heap->items[i] = heap->items[child];
+        }
+        if (heap->count > 0)
+            heap->items[i] = last;
+        atomic_store(&heap->top, heap->count > 0 ? heap->items[0]->time : LONG_MAX);
+        atomic_fetch_sub(&mq->count, 1);
+        pthread_mutex_unlock(&heap->lock);
+        return alarm;
+    }
+    return NULL;
+}
+
+/*
+ * Parallel expiry. With --fire-threads N the alarm thread still
+ * detaches each slice under alarm_mutex, but hands it to N firing
+ * threads through a MultiQueue instead of dispatching it itself, and
+ * sleeps until they are done. The batch stays in firing_batch until
+ * then, so alarm_await_cancel keeps its guarantee.
+ */
+int fire_thread_count = 0;
+multiqueue_t fire_queue;
+sem_t fire_ready;
+atomic_int fire_left;
+
+/*
+ * Report one expired alarm: run its completion hook or print it.
+ * Called without alarm_mutex held.
+ */
+void fire_alarm(alarm_t *alarm) {
+    struct timespec now;
+
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+    now.tv_sec = alarm_now();
+    now.tv_nsec = 0;
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    histogram_add(fire_lateness, &fire_lateness_sum,
+                  (now.tv_sec - alarm->time) * 1000000L + now.tv_nsec / 1000);
+    if (alarm->on_fire != NULL)
+        alarm->on_fire(alarm, alarm->context);
+    else
+        printf("(%d) %s\n", alarm->seconds, alarm->message);
+    STAT_INC(fires);
+    TRACE(TRACE_FIRE, alarm->id, 0);
+    event_publish(EVENT_EXPIRE, alarm, alarm->Alarm_Time_Group_Number);
+}
+
+void *fire_thread(void *arg) {
+    alarm_t *alarm;
+    int status;
+
+    while (1) {
+        while (sem_wait(&fire_ready) != 0)
+            ;
+        alarm = mq_pop(&fire_queue);
+        if (alarm == NULL)
+            continue;
+        fire_alarm(alarm);
+        // The last alarm of the slice wakes the alarm thread
+        if (atomic_fetch_sub(&fire_left, 1) == 1) {
+            status = alarm_lock();
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            status = pthread_cond_broadcast(&firing_cond);
+            if (status != 0)
+                err_abort(status, "Broadcast cond");
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+        }
+    }
+}
+
+/*
+ * Thread-local timers. A thread that starts and cancels its own
+ * alarms can keep them in a heap of its own instead of alarm_list:
+ * the heap's lock is only ever contended by the alarm thread taking
+ * due alarms out of it, and the stores, indexes and alarm_mutex are
+ * never touched. Each heap publishes its earliest deadline (0 when
+ * empty) in local_deadlines, which the alarm thread scans alongside
+ * the stores. A thread cancelling another thread's alarm posts the
+ * handle to that heap's inbox, which is drained by whoever next holds
+ * the heap's lock. Local alarms have no group or display thread and
+ * fire through fire_alarm() like any other.
+ *
+ * Handles are heap << 56 | generation << 32 | slot, with a per-heap
+ * slot table like the global one, so a stale handle is rejected.
+ * Only 24 bits of generation fit, so slot generations wrap there.
+ * When a thread exits, its heap is left to fire and is handed to the
+ * next thread that needs one.
+ */
+#define LOCAL_HEAPS_MAX         256
+#define LOCAL_GENERATION_MASK   0xffffff
+
+typedef struct local_cancel {
+    unsigned long       handle;
+    struct local_cancel *next;
+} local_cancel_t;
+
+typedef struct local_heap {
+    pthread_mutex_t     lock;
+    alarm_t             **items;
+    int                 count, size;
+    alarm_slot_t        *slots;
+    int                 slot_count, slot_size, slot_free;
+    _Atomic(local_cancel_t *) inbox;
+    atomic_int          released;       /* owner exited, free to claim */
+} __attribute__((aligned(CACHE_LINE))) local_heap_t;
+
+local_heap_t local_heaps[LOCAL_HEAPS_MAX];
+atomic_long local_deadlines[LOCAL_HEAPS_MAX];
+atomic_int local_heap_count;
+static __thread local_heap_t *thread_local_heap = NULL;
+pthread_key_t local_key;
+pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Deadline the alarm thread is sleeping until (LONG_MAX: no deadline),
+ * or 0 while it is awake. A local insert only has to wake it when
+ * the new deadline is earlier.
+ */
+atomic_long alarm_sleep_until;
+
+static void local_release(void *arg) {
+    atomic_store(&((local_heap_t *)arg)->released, 1);
+}
+
+static void local_init(void) {
+    int status = pthread_key_create(&local_key, local_release);
+
+    if (status != 0)
+        err_abort(status, "Create local heap key");
+}
+
+static local_heap_t *local_self(void) {
+    local_heap_t *heap;
+    int i, released, count;
+
+    if (thread_local_heap != NULL)
+        return thread_local_heap;
+    pthread_once(&local_once, local_init);
+    count = atomic_load(&local_heap_count);
+    for (i = 0; i < count; i++) {
+        released = 1;
+        if (atomic_compare_exchange_strong(&local_heaps[i].released, &released, 0))
+            break;
+    }
+    if (i == count) {
+        i = atomic_fetch_add(&local_heap_count, 1);
+        if (i >= LOCAL_HEAPS_MAX) {
+            atomic_fetch_sub(&local_heap_count, 1);
+            return NULL;
+        }
+        heap = &local_heaps[i];
+        pthread_mutex_init(&heap->lock, NULL);
+        heap->slot_free = -1;
+    }
+    pthread_setspecific(local_key, &local_heaps[i]);
+    thread_local_heap = &local_heaps[i];
+    return thread_local_heap;
+}
+
+static inline void local_set(local_heap_t *heap, int i, alarm_t *alarm) {
+    heap->items[i] = alarm;
+    alarm->heap_index = i;
+}
+
+static void local_sift(local_heap_t *heap, int i) {
+    alarm_t *alarm = heap->items[i];
+    int parent, child;
+
+    for (; i > 0 && store_before(alarm, heap->items[parent = (i - 1) / 2]); i = parent)
+        local_set(heap, i, heap->items[parent]);
+    for (; (child = 2 * i + 1) < heap->count; i = child) {
+        if (child + 1 < heap->count
+            && store_before(heap->items[child + 1], heap->items[child]))
+            child++;
+        if (!store_before(heap->items[child], alarm))
+            break;
+        local_set(heap, i, heap->items[child]);
+    }
+    local_set(heap, i, alarm);
+}
+
+// Remove alarm from its heap and free it. Requires the heap's lock.
+static void local_remove(local_heap_t *heap, alarm_t *alarm) {
+    alarm_slot_t *entry = &heap->slots[alarm->slot];
+    int i = alarm->heap_index;
+
+    if (--heap->count != i) {
+        local_set(heap, i, heap->items[heap->count]);
+        local_sift(heap, i);
+    }
+    entry->alarm = NULL;
+    entry->generation = (entry->generation + 1) & LOCAL_GENERATION_MASK;
+    if (entry->generation == 0)
+        entry->generation = 1;
+    entry->next_free = heap->slot_free;
+    heap->slot_free = alarm->slot;
+    atomic_store(&local_deadlines[heap - local_heaps],
+                 heap->count > 0 ? heap->items[0]->time : 0);
+}
+
+static alarm_t *local_lookup(local_heap_t *heap, unsigned long handle) {
+    unsigned int slot = handle & 0xffffffffUL;
+
+    if (slot >= (unsigned int)heap->slot_count
+        || heap->slots[slot].generation != ((handle >> 32) & LOCAL_GENERATION_MASK))
+        return NULL;
+    return heap->slots[slot].alarm;
+}
+
+// Apply cancels posted by other threads. Requires the heap's lock.
+static void local_drain(local_heap_t *heap) {
+    local_cancel_t *message, *next;
+    alarm_t *alarm;
+
+    for (message = atomic_exchange(&heap->inbox, NULL); message != NULL; message = next) {
+        next = message->next;
+        alarm = local_lookup(heap, message->handle);
+        if (alarm != NULL) {
+            local_remove(heap, alarm);
+            free(alarm);
+            STAT_INC(cancels);
+        }
+        free(message);
+    }
+}
+
+/*
+ * Start an alarm in the calling thread's heap. Returns its handle, or
+ * 0 if it could not be created.
+ */
+unsigned long local_alarm_start(int seconds, const char *message,
+                                alarm_fire_fn on_fire, void *context) {
+    local_heap_t *heap = local_self();
+    alarm_slot_t *slots;
+    alarm_t *alarm;
+    unsigned long handle;
+    time_t deadline;
+    int slot, size, status;
+
+    if (heap == NULL)
+        return 0;
+    alarm = (alarm_t *)malloc(sizeof(alarm_t));
+    if (alarm == NULL)
+        return 0;
+    alarm->seconds = seconds;
+    alarm->time = alarm_clock() + seconds;
+    strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+    alarm->message[sizeof(alarm->message) - 1] = '\0';
+    alarm->priority = ALARM_PRIORITY_DEFAULT;
+    alarm->on_fire = on_fire;
+    alarm->context = context;
+
+    status = pthread_mutex_lock(&heap->lock);
+    if (status != 0)
+        err_abort(status, "Lock local heap");
+    local_drain(heap);
+    if (heap->count == heap->size || (heap->slot_free < 0 && heap->slot_count == heap->slot_size)) {
+        size = heap->size ? heap->size * 2 : 64;
+        heap->items = realloc(heap->items, size * sizeof(alarm_t *));
+        slots = realloc(heap->slots, size * sizeof(alarm_slot_t));
+        if (heap->items == NULL || slots == NULL)
+            errno_abort("Grow local heap");
+        heap->slots = slots;
+        heap->size = heap->slot_size = size;
+    }
+    if (heap->slot_free >= 0) {
+        slot = heap->slot_free;
+        heap->slot_free = heap->slots[slot].next_free;
+    } else {
+        slot = heap->slot_count++;
+        heap->slots[slot].generation = 1;
+    }
+    heap->slots[slot].alarm = alarm;
+    alarm->slot = slot;
+    alarm->id = slot;
+    handle = (unsigned long)(heap - local_heaps) << 56
+        | (unsigned long)heap->slots[slot].generation << 32 | slot;
+    local_set(heap, heap->count++, alarm);
+    local_sift(heap, alarm->heap_index);
+    // Once unlocked the alarm may fire and be freed at any time
+    deadline = heap->items[0] == alarm ? alarm->time : LONG_MAX;
+    if (deadline != LONG_MAX)
+        atomic_store(&local_deadlines[heap - local_heaps], deadline);
+    status = pthread_mutex_unlock(&heap->lock);
+    if (status != 0)
+        err_abort(status, "Unlock local heap");
+    STAT_INC(inserts);
+
+    // Wake the alarm thread only if this is now the earliest deadline
+    if (deadline < atomic_load(&alarm_sleep_until)) {
+        status = alarm_lock();
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        clock_kick();
+        status = pthread_cond_signal(&alarm_cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+    }
+    return handle;
+}
+
+/*
+ * Cancel a local alarm. From the owning thread this returns 1 if the
+ * alarm was cancelled and 0 if it had already fired. Any other thread
+ * posts the cancel to the owner's inbox and gets -1: the alarm will
+ * not fire unless the alarm thread had already taken it.
+ */
+int local_alarm_cancel(unsigned long handle) {
+    local_heap_t *heap;
+    local_cancel_t *message;
+    alarm_t *alarm;
+    int status, cancelled = 0;
+
+    if ((handle >> 56) >= (unsigned long)atomic_load(&local_heap_count))
+        return 0;
+    heap = &local_heaps[handle >> 56];
+    if (heap != thread_local_heap) {
+        message = (local_cancel_t *)malloc(sizeof(local_cancel_t));
+        if (message == NULL)
+            return 0;
+        message->handle = handle;
+        message->next = atomic_load(&heap->inbox);
+        while (!atomic_compare_exchange_weak(&heap->inbox, &message->next, message))
+            ;
+        return -1;
+    }
+    status = pthread_mutex_lock(&heap->lock);
+    if (status != 0)
+        err_abort(status, "Lock local heap");
+    local_drain(heap);
+    alarm = local_lookup(heap, handle);
+    if (alarm != NULL) {
+        local_remove(heap, alarm);
+        free(alarm);
+        cancelled = 1;
+        STAT_INC(cancels);
+    }
+    status = pthread_mutex_unlock(&heap->lock);
+    if (status != 0)
+        err_abort(status, "Unlock local heap");
+    return cancelled;
+}
+
+/*
+ * Earliest published local deadline, or 0 if every heap is empty.
+ */
+time_t local_earliest(void) {
+    time_t deadline, earliest = 0;
+    int i, count = atomic_load(&local_heap_count);
+
+    for (i = 0; i < count; i++) {
+        deadline = atomic_load(&local_deadlines[i]);
+        if (deadline != 0 && (earliest == 0 || deadline < earliest))
+            earliest = deadline;
+    }
+    return earliest;
+}
+
+/*
+ * Fire every local alarm due by now. Called by the alarm thread
+ * without alarm_mutex held; each heap is locked only long enough to
+ * take its due alarms out.
+ */
+void local_fire_due(time_t now) {
+    alarm_t *due[ALARM_SLICE_MAX];
+    local_heap_t *heap;
+    time_t deadline;
+    int i, j, n, status, count = atomic_load(&local_heap_count);
+
+    for (i = 0; i < count; i++) {
+        deadline = atomic_load(&local_deadlines[i]);
+        while (deadline != 0 && deadline <= now) {
+            heap = &local_heaps[i];
+            status = pthread_mutex_lock(&heap->lock);
+            if (status != 0)
+                err_abort(status, "Lock local heap");
+            local_drain(heap);
+            for (n = 0; n < ALARM_SLICE_MAX && heap->count > 0
+                     && heap->items[0]->time <= now; n++) {
+                due[n] = heap->items[0];
+                local_remove(heap, due[n]);
+            }
+            deadline = heap->count > 0 ? heap->items[0]->time : 0;
+            status = pthread_mutex_unlock(&heap->lock);
+            if (status != 0)
+                err_abort(status, "Unlock local heap");
+            for (j = 0; j < n; j++) {
+                fire_alarm(due[j]);
+                free(due[j]);
+            }
+        }
+    }
+}
+
+/*
+ * The alarm thread re-scans the heaps from the top class for every
+ * alarm it puts into a slice, so during an expiry burst a due
+ * top-class alarm waits for at most one slice before it is fired.
+ */
+void *alarm_thread (void *arg) {
+    alarm_t *alarm;
+    struct timespec slice_start;
+#if ALARM_CLOCK != ALARM_CLOCK_VIRTUAL
+    struct timespec cond_time;
+#endif
+    time_t now, next_time, local_time;
+    int status, temp, i;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    while (1) {
+        now = alarm_clock();
+        local_time = local_earliest();
+        if (local_time != 0 && local_time <= now) {
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            local_fire_due(now);
+            status = alarm_lock();
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+        }
+        alarm = next_expired_alarm(now, &next_time);
+
+        if (alarm == NULL) {
+            local_time = local_earliest();
+            if (local_time != 0 && local_time <= now)
+                continue;
+            if (local_time != 0 && (next_time == 0 || local_time < next_time))
+                next_time = local_time;
+            // Publish the deadline, then recheck for a local insert that missed it
+            atomic_store(&alarm_sleep_until, next_time == 0 ? LONG_MAX : next_time);
+            local_time = local_earliest();
+            if (local_time != 0 && (next_time == 0 || local_time < next_time)) {
+                atomic_store(&alarm_sleep_until, 0);
+                continue;
+            }
+            // Nothing due: wait for the earliest deadline or a new insert
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+            clock_wait(next_time);
+#else
+            if (next_time == 0) {
+                status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Wait on cond");
+            } else {
+                cond_time.tv_sec = next_time;
+                cond_time.tv_nsec = 0;
+                status = pthread_cond_timedwait(&alarm_cond, &alarm_mutex, &cond_time);
+                if (status != 0 && status != ETIMEDOUT)
+                    err_abort(status, "Cond timedwait");
+            }
+#endif
+            atomic_store(&alarm_sleep_until, 0);
+            continue;
+        }
+
+        // Time for these alarms has come: detach one slice of them
+        clock_gettime(CLOCK_MONOTONIC, &slice_start);
+        do {
+            temp = alarm->Alarm_Time_Group_Number;
+            store_pop(&alarm_stores[alarm->priority], alarm);
+            alarm->time += alarm_shift;
+            remove_alarm(&alarm_list, alarm);
+            if(!has_alarms_in_group(temp)){
+                terminate_display_thread_for_group(temp);
+                printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                    temp, alarm_now());
+            }
+            firing_batch[firing_count++] = alarm;
+            TRACE(TRACE_EXPIRE, alarm->id, temp);
+            if (firing_count >= slice_max_alarms
+                || usec_since(&slice_start) >= slice_max_usec)
+                break;
+            alarm = next_expired_alarm(now, &next_time);
+        } while (alarm != NULL);
+
+        if (fire_thread_count > 0) {
+            // Fan the slice out and wait for the firing threads
+            atomic_store(&fire_left, firing_count);
+            for (i = 0; i < firing_count; i++) {
+                mq_push(&fire_queue, firing_batch[i]);
+                sem_post(&fire_ready);
+            }
+            while (atomic_load(&fire_left) > 0) {
+                status = pthread_cond_wait(&firing_cond, &alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Wait on cond");
+            }
+        } else {
+            // Unlock the mutex before processing the alarms to allow other threads to work
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+
+            // Process the alarms
+            for (i = 0; i < firing_count; i++)
+                fire_alarm(firing_batch[i]);
+
+            status = alarm_lock();
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+        }
+        for (i = 0; i < firing_count; i++) {
+            TRACE(TRACE_FREE, firing_batch[i]->id, 0);
+            free(firing_batch[i]); // Assuming alarm is dynamically allocated
+        }
+        firing_count = 0;
+        status = pthread_cond_broadcast(&firing_cond);
+        if (status != 0)
+            err_abort(status, "Broadcast cond");
+
+        // Let commands that arrived during the slice go first, but
+        // not the ones that arrive after it
+        i = atomic_fetch_xor(&commands_epoch, 1) & 1;
+        atomic_store(&commands_waiting, 1);
+        while (atomic_load(&commands_pending[i]) > 0) {
+            status = pthread_cond_wait(&commands_cond, &alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on cond");
+        }
+        atomic_store(&commands_waiting, 0);
+    }
+}
+
+
+/*
+ * Replace the alarm with the given id, or the one named by handle
+ * when handle is non-zero, by newAlarm, whose duration and message
+ * the caller has filled in. The old alarm is swapped for the new one
+ * in a single alarm_mutex hold, so the alarm thread never sees the
+ * id missing. Expects alarm_mutex to be held. Returns 0 on success,
+ * with newAlarm->id set, or -1 if there was no such alarm.
+ */
+int replace_alarm_locked(int alarm_id, unsigned long handle, alarm_t *newAlarm) {
+    alarm_t *foundAlarm;
+    int temp;
+
+    foundAlarm = handle != 0 ? handle_lookup(handle) : find(alarm_id);
+
+    if (foundAlarm != NULL) {
+        alarm_id = foundAlarm->id;
+        newAlarm->id = alarm_id;
+        newAlarm->priority = foundAlarm->priority;
+        newAlarm->on_fire = foundAlarm->on_fire;
+        newAlarm->context = foundAlarm->context;
+
+        // Remove the existing alarm from the list
+        temp = foundAlarm->Alarm_Time_Group_Number;
+        store_detach(foundAlarm);
+        remove_alarm(&alarm_list, foundAlarm);
+        if(temp != newAlarm->Alarm_Time_Group_Number && !has_alarms_in_group(temp)){
+            terminate_display_thread_for_group(temp);
+            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                temp, alarm_now());
+        }
+
+        // Insert the new alarm into the list; the id was just freed up
+        insert_alarm_locked(newAlarm);
+
+        // Free the memory of the old alarm, if dynamically allocated
+        free(foundAlarm);
+
+        printf("Alarm(%d) Replaced at %ld: %s\n", alarm_id, alarm_now(), newAlarm->message);
+        STAT_INC(replaces);
+        TRACE(TRACE_REPLACE, alarm_id, newAlarm->seconds);
+        return 0;
+    } else if (handle != 0) {
+        fprintf(stderr, "Alarm handle @%lx not found\n", handle);
+    } else {
+        // Handle the case where the alarm is not found
+        fprintf(stderr, "Alarm ID %d not found\n", alarm_id);
+    }
+    return -1;
+}
+
+int replace_alarm(int alarm_id, unsigned long handle, int seconds, const char *message) {
+    alarm_t *newAlarm;
+    int status, result;
+
+    // Allocate and set up the new alarm before taking the lock
+    newAlarm = (alarm_t *)malloc(sizeof(alarm_t));
+    if (newAlarm == NULL) {
+        fprintf(stderr, "Memory allocation failed for replacement alarm\n");
+        return -1;
+    }
+    newAlarm->seconds = seconds;
+    newAlarm->Alarm_Time_Group_Number = (seconds + 4) / 5;
+    strncpy(newAlarm->message, message, sizeof(newAlarm->message) - 1);
+    newAlarm->message[sizeof(newAlarm->message) - 1] = '\0';
+
+    if (flat_combining) {
+        result = combine(COMBINE_REPLACE, newAlarm, alarm_id, handle);
+        alarm_id = thread_combine->id;
+    } else {
+        status = alarm_lock();
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        result = replace_alarm_locked(alarm_id, handle, newAlarm);
+        alarm_id = newAlarm->id;
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+    }
+
+    if (result != 0) {
+        free(newAlarm);
+        return -1;
+    }
+    check_and_insert(alarm_id);
+    return 0;
+}
+
+/*
+ * Start an alarm, or if one with this id is already pending update
+ * its duration and message in place, keeping its handle, priority
+ * and completion hook. Repeated submissions of the same id therefore
+ * never grow the list. Returns 0, or -1 on allocation failure.
+ */
+int upsert_alarm(int alarm_id, int seconds, const char *message) {
+    alarm_t *alarm;
+    int status, oldGroupNumber;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    alarm = find(alarm_id);
+    if (alarm != NULL) {
+        oldGroupNumber = alarm->Alarm_Time_Group_Number;
+        store_detach(alarm);
+        alarm->paused = 0;
+        alarm->seconds = seconds;
+        alarm->time = alarm_clock() + seconds - alarm_shift;
+        alarm->Alarm_Time_Group_Number = (seconds + 4) / 5;
+        group_adjust(oldGroupNumber, -1);
+        group_adjust(alarm->Alarm_Time_Group_Number, 1);
+        strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+        alarm->message[sizeof(alarm->message) - 1] = '\0';
+        store_push(&alarm_stores[alarm->priority], alarm);
+        clock_kick();
+        status = pthread_cond_signal(&alarm_cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+        printf("Alarm(%d) Updated at %ld: %s\n", alarm_id, alarm_now(), alarm->message);
+        STAT_INC(replaces);
+        TRACE(TRACE_REPLACE, alarm_id, seconds);
+        if (!has_alarms_in_group(oldGroupNumber)) {
+            terminate_display_thread_for_group(oldGroupNumber);
+            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                oldGroupNumber, alarm_now());
+        }
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+        check_and_insert(alarm_id);
+        return 0;
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+
+    alarm = (alarm_t *)malloc(sizeof(alarm_t));
+    if (alarm == NULL)
+        return -1;
+    alarm->id = alarm_id;
+    alarm->seconds = seconds;
+    strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+    alarm->message[sizeof(alarm->message) - 1] = '\0';
+    alarm->link = NULL;
+    alarm->Alarm_Time_Group_Number = (seconds + 4) / 5;
+    alarm->priority = ALARM_PRIORITY_DEFAULT;
+    alarm->on_fire = NULL;
+    alarm->context = NULL;
+    // Lost a race with another insert of the same id: update that one
+    if (insert_alarm(alarm) != 0) {
+        free(alarm);
+        return upsert_alarm(alarm_id, seconds, message);
+    }
+    check_and_insert(alarm_id);
+    return 0;
+}
+
+/*
+ * Cancel the alarm with the given id, or the one named by handle
+ * when handle is non-zero. A handle reaches the alarm directly.
+ * cancel_alarm_locked expects alarm_mutex to be held and returns 0,
+ * or -1 if there was no such alarm.
+ */
+int cancel_alarm_locked(int alarm_id, unsigned long handle) {
+    alarm_t *foundAlarm;
+    int tempGroupNumber;
+
+    // Find the alarm to cancel
+    foundAlarm = handle != 0 ? handle_lookup(handle) : find(alarm_id);
+
+    if (foundAlarm != NULL) {
+        alarm_id = foundAlarm->id;
+        // Store the group number before removing the alarm
+        tempGroupNumber = foundAlarm->Alarm_Time_Group_Number;
+
+        // Remove the alarm from its heap and the list
+        store_detach(foundAlarm);
+        remove_alarm(&alarm_list, foundAlarm);
+
+        // Free the alarm structure
+        free(foundAlarm);
+        STAT_INC(cancels);
+        TRACE(TRACE_CANCEL, alarm_id, 0);
+
+        // Check if any alarms are left in the removed alarm's group
+        if (!has_alarms_in_group(tempGroupNumber)) {
+            // Terminate the display thread for this group
+            terminate_display_thread_for_group(tempGroupNumber);
+            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                tempGroupNumber, alarm_now());
+        }
+        return 0;
+    } else if (handle != 0) {
+        fprintf(stderr, "Alarm handle @%lx not found\n", handle);
+    } else {
+        fprintf(stderr, "Alarm ID %d not found\n", alarm_id);
+    }
+    return -1;
+}
+
+void cancel_alarm(int alarm_id, unsigned long handle) {
+    int status;
+
+    if (flat_combining) {
+        combine(COMBINE_CANCEL, NULL, alarm_id, handle);
+        return;
+    }
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    cancel_alarm_locked(alarm_id, handle);
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Bulk operations. cancel_alarms_locked removes every alarm whose id
+ * is in [first_id, last_id] and, unless group is ALARM_ANY_GROUP,
+ * whose Alarm_Time_Group_Number is group, in one walk of the id
+ * ordered alarm_list. Emptied groups are torn down once at the end
+ * rather than after each alarm. Must be called with alarm_mutex
+ * held; returns the number of alarms cancelled.
+ */
+#define ALARM_ANY_GROUP         INT_MIN
+#define ALARM_BATCH_MAX         16
+
+static int group_compare(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+int cancel_alarms_locked(int first_id, int last_id, int group) {
+    alarm_t *alarm = alarm_list, *next;
+    int *groups = NULL, *grown;
+    int count = 0, capacity = 0, i;
+
+    while (alarm != NULL && alarm->id <= last_id) {
+        next = alarm->link;
+        if (alarm->id >= first_id
+                && (group == ALARM_ANY_GROUP || alarm->Alarm_Time_Group_Number == group)) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                grown = realloc(groups, capacity * sizeof(int));
+                if (grown == NULL)
+                    break;      // what was cancelled so far still gets its teardown
+                groups = grown;
+            }
+            groups[count++] = alarm->Alarm_Time_Group_Number;
+            TRACE(TRACE_CANCEL, alarm->id, 0);
+            store_detach(alarm);
+            remove_alarm(&alarm_list, alarm);
+            free(alarm);
+            STAT_INC(cancels);
+        }
+        alarm = next;
+    }
+
+    // One teardown check per distinct group touched
+    if (count > 0)
+        qsort(groups, count, sizeof(int), group_compare);
+    for (i = 0; i < count; i++) {
+        if (i > 0 && groups[i] == groups[i - 1])
+            continue;
+        if (!has_alarms_in_group(groups[i])) {
+            terminate_display_thread_for_group(groups[i]);
+            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                groups[i], alarm_now());
+        }
+    }
+    free(groups);
+    return count;
+}
+
+int cancel_alarms(int first_id, int last_id, int group) {
+    int status, count;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    count = cancel_alarms_locked(first_id, last_id, group);
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return count;
+}
+
+/*
+ * Insert a batch of alarms under a single hold of alarm_mutex, then
+ * make sure each distinct group among them has a display thread.
+ * The batch goes in whole or not at all: if any id is already pending
+ * or appears twice in it, every alarm is freed and -1 returned.
+ */
+int insert_alarms(alarm_t **alarms, int n) {
+    int groups[ALARM_BATCH_MAX], ids[ALARM_BATCH_MAX];
+    int status, i, j, distinct = 0, conflict = 0, conflict_id = 0;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    for (i = 0; i < n && !conflict; i++) {
+        conflict = find(alarms[i]->id) != NULL;
+        for (j = 0; j < i && !conflict; j++)
+            conflict = alarms[j]->id == alarms[i]->id;
+        conflict_id = alarms[i]->id;
+    }
+    for (i = 0; i < n && !conflict; i++) {
+        insert_alarm_locked(alarms[i]);
+        for (j = 0; j < distinct; j++)
+            if (groups[j] == alarms[i]->Alarm_Time_Group_Number)
+                break;
+        if (j == distinct) {
+            groups[distinct] = alarms[i]->Alarm_Time_Group_Number;
+            ids[distinct++] = alarms[i]->id;
+        }
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    if (conflict) {
+        fprintf(stderr, "Alarm ID %d already exists or repeats: none started\n", conflict_id);
+        for (i = 0; i < n; i++)
+            free(alarms[i]);
+        return -1;
+    }
+    for (j = 0; j < distinct; j++)
+        check_and_insert(ids[j]);
+    return 0;
+}
+
+/*
+ * Postpone every pending alarm by seconds (or bring it forward, if
+ * negative). Only alarm_shift moves, so this takes constant time
+ * however many alarms are pending. Alarms on the thread-local heaps
+ * and wall clock alarms, which are due at a fixed time of day, are
+ * not shifted.
+ *
+ * The radix heap is the exception: it needs every key pushed to be
+ * at least the last deadline it fired, and with a lazy offset the
+ * keys of alarms started after a shift would fall below that and be
+ * misordered. There every pending alarm is re-keyed instead, and
+ * alarm_shift stays 0.
+ */
+void shift_all(int seconds) {
+    int status;
+#if ALARM_STORE == ALARM_STORE_RADIX
+    alarm_t *alarm;
+#endif
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+#if ALARM_STORE == ALARM_STORE_RADIX
+    for (alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
+        if (alarm->paused || alarm->wall_index >= 0)
+            continue;
+        store_remove(&alarm_stores[alarm->priority], alarm);
+        alarm->time += seconds;
+        store_push(&alarm_stores[alarm->priority], alarm);
+    }
+#else
+    alarm_shift += seconds;
+#endif
+    // The alarm thread may be asleep until a deadline that just moved
+    clock_kick();
+    status = pthread_cond_signal(&alarm_cond);
+    if (status != 0)
+        err_abort(status, "Signal cond");
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Postpone the pending alarms of one group by seconds. The groups
+ * share the per-priority stores, so a per-group offset would break
+ * their ordering: the group's alarms are re-keyed instead, in one
+ * pass under one lock hold. Returns the number of alarms moved.
+ */
+int shift_group(int group_number, int seconds) {
+    alarm_t *alarm;
+    int status, count = 0;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    for (alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
+        if (alarm->Alarm_Time_Group_Number != group_number
+                || alarm->paused || alarm->wall_index >= 0)
+            continue;
+        store_remove(&alarm_stores[alarm->priority], alarm);
+        alarm->time += seconds;
+        store_push(&alarm_stores[alarm->priority], alarm);
+        count++;
+    }
+    clock_kick();
+    status = pthread_cond_signal(&alarm_cond);
+    if (status != 0)
+        err_abort(status, "Signal cond");
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return count;
+}
+
+/*
+ * Pause an alarm: take it out of its store but leave it listed,
+ * indexed and reachable through its handle, remembering how long it
+ * had left. Resuming puts it back with that much time to go, a
+ * single store insert with no allocation. Paused alarms are not
+ * shown by the display threads but keep their group alive. A paused
+ * wall clock alarm resumes as a relative one. Both
+ * expect alarm_mutex to be held and return 0, or -1 if the alarm was
+ * already in that state.
+ */
+int pause_alarm_locked(alarm_t *alarm) {
+    if (alarm->paused)
+        return -1;
+    if (alarm->wall_index >= 0)
+        alarm->remaining = alarm->time - alarm_now();
+    else
+        alarm->remaining = alarm->time + alarm_shift - alarm_clock();
+    store_detach(alarm);
+    if (alarm->remaining < 0)
+        alarm->remaining = 0;
+    alarm->paused = 1;
+    return 0;
+}
+
+int resume_alarm_locked(alarm_t *alarm) {
+    if (!alarm->paused)
+        return -1;
+    alarm->time = alarm_clock() + alarm->remaining - alarm_shift;
+    alarm->paused = 0;
+    store_push(&alarm_stores[alarm->priority], alarm);
+    return 0;
+}
+
+/*
+ * Pause (pause != 0) or resume the alarm with the given id, or the
+ * one named by handle when handle is non-zero, or when group is not
+ * ALARM_ANY_GROUP every alarm in that group. Returns the number of
+ * alarms whose state changed.
+ */
+int pause_alarms(int alarm_id, unsigned long handle, int group, int pause) {
+    alarm_t *alarm;
+    int status, count = 0;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    if (group != ALARM_ANY_GROUP) {
+        for (alarm = alarm_list; alarm != NULL; alarm = alarm->link)
+            if (alarm->Alarm_Time_Group_Number == group)
+                count += (pause ? pause_alarm_locked(alarm) : resume_alarm_locked(alarm)) == 0;
+    } else {
+        alarm = handle != 0 ? handle_lookup(handle) : find(alarm_id);
+        if (alarm != NULL)
+            count = (pause ? pause_alarm_locked(alarm) : resume_alarm_locked(alarm)) == 0;
+        else if (handle != 0)
+            fprintf(stderr, "Alarm handle @%lx not found\n", handle);
+        else
+            fprintf(stderr, "Alarm ID %d not found\n", alarm_id);
+    }
+    if (count > 0 && !pause) {
+        // A resumed alarm may now be the earliest deadline
+        clock_kick();
+        status = pthread_cond_signal(&alarm_cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return count;
+}
+
+/*
+ * Wall clock alarms. wall_thread sleeps on a timerfd armed for the
+ * earliest epoch deadline with TFD_TIMER_CANCEL_ON_SET, so the read
+ * returns ECANCELED as soon as the system clock is set. Either way it
+ * only has to look at the top of wall_alarms: due alarms are moved
+ * into their store with a deadline of now, and the timer re-armed
+ * for the new top. The thread and timer are created on first use.
+ */
+#if ALARM_CLOCK != ALARM_CLOCK_VIRTUAL
+int wall_fd = -1;
+pthread_once_t wall_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Arm the timer for the earliest wall alarm. Expects alarm_mutex to
+ * be held.
+ */
+static void wall_arm(void) {
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+
+    if (wall_count == 0)
+        return;
+    // A zero it_value would disarm: a deadline already past fires at once
+    spec.it_value.tv_sec = wall_alarms[0]->time > 0 ? wall_alarms[0]->time : 1;
+    if (timerfd_settime(wall_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) != 0)
+        errno_abort("Arm wall clock timer");
+}
+
+void *wall_thread(void *arg) {
+    uint64_t expirations;
+    alarm_t *alarm;
+    int status, moved;
+
+    while (1) {
+        if (read(wall_fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno == ECANCELED)
+                printf("System Clock Changed at %ld: Wall Clock Alarms Rechecked\n", alarm_now());
+            else if (errno != EINTR)
+                errno_abort("Read wall clock timer");
+        }
+        status = alarm_lock();
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        moved = 0;
+        while (wall_count > 0 && wall_alarms[0]->time <= alarm_now()) {
+            alarm = wall_alarms[0];
+            wall_remove(alarm);
+            alarm->time = alarm_clock() - alarm_shift;
+            store_push(&alarm_stores[alarm->priority], alarm);
+            moved++;
+        }
+        if (moved > 0) {
+            clock_kick();
+            status = pthread_cond_signal(&alarm_cond);
+            if (status != 0)
+                err_abort(status, "Signal cond");
+        }
+        wall_arm();
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+    }
+    return NULL;
+}
+
+static void wall_start(void) {
+    pthread_t thread;
+    int status;
+
+    wall_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if (wall_fd < 0)
+        errno_abort("Create wall clock timer");
+    status = pthread_create(&thread, NULL, wall_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create wall clock thread");
+    pthread_detach(thread);
+}
+#endif
+
+/*
+ * Start an alarm due at the given time since the Epoch on the wall
+ * clock, following any later change to the system clock. On the
+ * virtual clock, which nothing else can set, it is simply a relative
+ * alarm. Returns 0, or -1 if allocation failed or the id is in use.
+ */
+int insert_alarm_at(alarm_t *alarm, time_t at) {
+    alarm->seconds = at > alarm_now() ? at - alarm_now() : 0;
+    alarm->Alarm_Time_Group_Number = (alarm->seconds + 4) / 5;
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+    return insert_alarm(alarm);
+#else
+    int status, result;
+
+    pthread_once(&wall_once, wall_start);
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    result = insert_alarm_locked(alarm);
+    if (result == 0) {
+        // Listed and indexed like any alarm, then parked on the wall heap
+        store_remove(&alarm_stores[alarm->priority], alarm);
+        alarm->time = at;
+        if (wall_push(alarm) != 0) {
+            // No room on the wall heap: keep the same deadline, on the
+            // monotonic clock only
+            alarm->time = alarm_clock() + (at - alarm_now()) - alarm_shift;
+            store_push(&alarm_stores[alarm->priority], alarm);
+        } else if (alarm->wall_index == 0) {
+            wall_arm();
+        }
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+#endif
+}
+
+/*
+ * Programmatic interface for embedding the alarm engine: register an
+ * alarm whose expiry calls on_fire(alarm, context) on the alarm
+ * thread rather than printing to stdout. The hook should hand the
+ * work off (e.g. resume a waiter on its own executor) and return
+ * quickly. Returns 0 on success, -1 if allocation failed or the id
+ * is already in use.
+ */
+int alarm_await(int id, int seconds, int priority, const char *message,
+                alarm_fire_fn on_fire, void *context) {
+    alarm_t *alarm;
+
+    alarm = (alarm_t *)malloc(sizeof(alarm_t));
+    if (alarm == NULL)
+        return -1;
+    alarm->id = id;
+    alarm->seconds = seconds;
+    strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+    alarm->message[sizeof(alarm->message) - 1] = '\0';
+    alarm->link = NULL;
+    alarm->Alarm_Time_Group_Number = (seconds + 4) / 5;
+    alarm->priority = priority;
+    alarm->on_fire = on_fire;
+    alarm->context = context;
+    if (insert_alarm(alarm) != 0) {
+        free(alarm);
+        return -1;
+    }
+    check_and_insert(id);
+    return 0;
+}
+
+/*
+ * Withdraw an alarm registered with alarm_await(), e.g. because its
+ * waiter is being destroyed. Returns 1 if the alarm was removed
+ * before firing, 0 if it had already fired. If its hook is running
+ * right now this waits for it to return, so once the call comes back
+ * the hook is guaranteed not to touch the context again. Must not be
+ * called from inside a hook for the alarm being fired.
+ */
+int alarm_await_cancel(int alarm_id) {
+    alarm_t *foundAlarm;
+    int status, tempGroupNumber, cancelled = 0;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    foundAlarm = find(alarm_id);
+    if (foundAlarm != NULL && foundAlarm->on_fire != NULL) {
+        tempGroupNumber = foundAlarm->Alarm_Time_Group_Number;
+        store_detach(foundAlarm);
+        remove_alarm(&alarm_list, foundAlarm);
+        free(foundAlarm);
+        cancelled = 1;
+        STAT_INC(cancels);
+        TRACE(TRACE_CANCEL, alarm_id, 0);
+        if (!has_alarms_in_group(tempGroupNumber)) {
+            terminate_display_thread_for_group(tempGroupNumber);
+            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
+                tempGroupNumber, alarm_now());
+        }
+    } else if (!pthread_equal(pthread_self(), alarm_thread_id)) {
+        while (firing_batch_contains(alarm_id)) {
+            status = pthread_cond_wait(&firing_cond, &alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on cond");
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return cancelled;
+}
+
+/*
+ * Delay queue: alarms started with alarm_start_pull() are not
+ * printed when they expire but copied into expired_queue, where
+ * consumers collect them with alarm_take() or alarm_take_batch(),
+ * earliest deadline first. The queue is a heap, so alarms fired out
+ * of order by parallel firing threads still come out in order. A
+ * producer only signals when a consumer is waiting, and a batch take
+ * empties up to n alarms in one lock hold and one wakeup. Taken
+ * records belong to the caller, who frees them.
+ */
+typedef struct expired_queue {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    alarm_t             **items;
+    int                 count, size;
+    int                 waiters;
+} expired_queue_t;
+
+expired_queue_t expired_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0
+};
+
+// Completion hook for pull alarms: runs on the alarm or a firing thread
+void expired_push(alarm_t *alarm, void *context) {
+    expired_queue_t *queue = (expired_queue_t *)context;
+    alarm_t *copy, **items;
+    int i, parent, status;
+
+    copy = (alarm_t *)malloc(sizeof(alarm_t));
+    if (copy == NULL) {
+        fprintf(stderr, "Memory allocation failed for expired alarm %d\n", alarm->id);
+        return;
+    }
+    *copy = *alarm;
+    copy->link = copy->prev = NULL;
+    copy->on_fire = NULL;
+    copy->context = NULL;
+
+    status = pthread_mutex_lock(&queue->mutex);
+    if (status != 0)
+        err_abort(status, "Lock expired queue");
+    if (queue->count == queue->size) {
+        queue->size = queue->size ? queue->size * 2 : 64;
+        items = realloc(queue->items, queue->size * sizeof(alarm_t *));
+        if (items == NULL)
+            errno_abort("Grow expired queue");
+        queue->items = items;
+    }
+    for (i = queue->count++; i > 0 && store_before(copy, queue->items[parent = (i - 1) / 2]); i = parent)
+        queue->items[i] = queue->items[parent];
+    queue->items[i] = copy;
+    if (queue->waiters > 0) {
+        status = pthread_cond_signal(&queue->cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+    }
+    status = pthread_mutex_unlock(&queue->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock expired queue");
+}
+
+static alarm_t *expired_pop(expired_queue_t *queue) {
+    alarm_t *top = queue->items[0], *last = queue->items[--queue->count];
+    int i, child;
+
+    for (i = 0; (child = 2 * i + 1) < queue->count; i = child) {
+        if (child + 1 < queue->count
+            && store_before(queue->items[child + 1], queue->items[child]))
+            child++;
+        if (!store_before(queue->items[child], last))
+            break;
+        queue->items[i] = queue->items[child];
+    }
+    if (queue->count > 0)
+        queue->items[i] = last;
+    return top;
+}
+
+/*
+ * Start an alarm whose expiry is delivered through alarm_take()
+ * instead of stdout. Returns 0, or -1 as alarm_await() does.
+ */
+int alarm_start_pull(int id, int seconds, int priority, const char *message) {
+    return alarm_await(id, seconds, priority, message, expired_push, &expired_queue);
+}
+
+/*
+ * Block until at least one pull alarm has expired, then take up to n
+ * of them, earliest first, into out. Returns how many were taken.
+ */
+int alarm_take_batch(alarm_t **out, int n) {
+    expired_queue_t *queue = &expired_queue;
+    int taken, status;
+
+    status = pthread_mutex_lock(&queue->mutex);
+    if (status != 0)
+        err_abort(status, "Lock expired queue");
+    queue->waiters++;
+    while (queue->count == 0) {
+        status = pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (status != 0)
+            err_abort(status, "Wait on cond");
+    }
+    queue->waiters--;
+    for (taken = 0; taken < n && queue->count > 0; taken++)
+        out[taken] = expired_pop(queue);
+    // Pass any leftovers on rather than leave them for the next push
+    if (queue->count > 0 && queue->waiters > 0) {
+        status = pthread_cond_signal(&queue->cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+    }
+    status = pthread_mutex_unlock(&queue->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock expired queue");
+    return taken;
+}
+
+alarm_t *alarm_take(void) {
+    alarm_t *alarm;
+
+    alarm_take_batch(&alarm, 1);
+    return alarm;
+}
+
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+// Whether a take would return without waiting
+static int expired_ready(void) {
+    int count;
+
+    pthread_mutex_lock(&expired_queue.mutex);
+    count = expired_queue.count;
+    pthread_mutex_unlock(&expired_queue.mutex);
+    return count > 0;
+}
+#endif
+
+/*
+ * Print command latency percentiles. Each is the upper bound of the
+ * log2 histogram bucket it falls in, or the lower bound of the last
+ * bucket, which has none.
+ */
+void print_command_latency(void) {
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+    unsigned long counts[LATENCY_BUCKETS], total = 0, seen;
+    int i, b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        counts[b] = atomic_load(&command_latency[b]);
+        total += counts[b];
+    }
+    printf("Command latency over %lu commands (slice %d alarms / %ld usec):\n",
+           total, slice_max_alarms, slice_max_usec);
+    for (i = 0; total > 0 && i < 5; i++) {
+        seen = 0;
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= total * percentiles[i] / 100)
+                break;
+        }
+        if (b < LATENCY_BUCKETS - 1)
+            printf("  p%-5g < %lu usec\n", percentiles[i], latency_bound(b));
+        else
+            printf("  p%-5g >= %lu usec\n", percentiles[i], latency_bound(LATENCY_BUCKETS - 2));
+    }
+}
+
+/*
+ * Sum every thread's counter block. The totals are a consistent
+ * lower bound, not a snapshot: other threads keep counting while the
+ * blocks are read.
+ */
+void print_stats(void) {
+    unsigned long inserts = 0, cancels = 0, replaces = 0;
+    unsigned long fires = 0, display_lines = 0, unknown = 0;
+    int blocks = 0;
+
+    for (alarm_stats_t *b = atomic_load(&stats_blocks); b != NULL; b = b->next) {
+        inserts += atomic_load_explicit(&b->inserts, memory_order_relaxed);
+        cancels += atomic_load_explicit(&b->cancels, memory_order_relaxed);
+        replaces += atomic_load_explicit(&b->replaces, memory_order_relaxed);
+        fires += atomic_load_explicit(&b->fires, memory_order_relaxed);
+        display_lines += atomic_load_explicit(&b->display_lines, memory_order_relaxed);
+        unknown += atomic_load_explicit(&b->unknown_commands, memory_order_relaxed);
+        blocks++;
+    }
+    printf("Stats: inserts %lu cancels %lu replaces %lu fires %lu "
+           "display lines %lu unknown commands %lu (%d counter blocks)\n",
+           inserts, cancels, replaces, fires, display_lines, unknown, blocks);
+}
+
+/*
+ * Count the calling thread's command in the current epoch until
+ * command_leave(). A command that may block, for instance on another
+ * alarm expiring, must leave first or the alarm thread waits on it.
+ */
+static __thread int command_slot = -1;
+
+void command_enter(void) {
+    command_slot = atomic_load(&commands_epoch) & 1;
+    atomic_fetch_add(&commands_pending[command_slot], 1);
+}
+
+void command_leave(void) {
+    int status;
+
+    if (command_slot < 0)
+        return;
+    if (atomic_fetch_sub(&commands_pending[command_slot], 1) == 1
+        && atomic_load(&commands_waiting)) {
+        // The alarm thread holds alarm_mutex until it is in the wait
+        status = alarm_lock();
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        status = pthread_cond_broadcast(&commands_cond);
+        if (status != 0)
+            err_abort(status, "Broadcast cond");
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+    }
+    command_slot = -1;
+}
+
+void apply_command(const char *input) {
+    int id, time, priority;
+    long at;
+    unsigned long handle;
+    char message[100]; // Adjust size as needed
+    alarm_t *new_alarm;
+    if (sscanf(input, "Replace_Alarm(@%lx): %d %99[^\n]", &handle, &time, message) == 3) {
+        printf("Replace Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, -1, time);
+        replace_alarm(0, handle, time, message);
+    } else if (sscanf(input, "Replace_Alarm(%d): %d %99[^\n]", &id, &time, message) == 3) {
+        printf("Replace Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, id, time);
+        // printf("Alarm ID: %d, Time: %d, Message: %s\n", id, time, message);
+        replace_alarm(id, 0, time, message);
+    } else if (sscanf(input, "Start_Alarm(%d, %d): %d %99[^\n]", &id, &priority, &time, message) == 4) {
+        printf("Start Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, id, time);
+        if (priority < 0 || priority >= ALARM_PRIORITIES) {
+            fprintf(stderr, "Alarm priority %d out of range 0-%d\n", priority, ALARM_PRIORITIES - 1);
+            return;
+        }
+        new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
+        if (new_alarm == NULL) {
+            fprintf(stderr, "Memory allocation failed for new alarm\n");
+            return;
+        }
+        new_alarm->id = id;
+        new_alarm->seconds = time;
+        strncpy(new_alarm->message, message, sizeof(new_alarm->message));
+        new_alarm->link = NULL;
+        new_alarm->Alarm_Time_Group_Number = (time + 4) / 5;
+        new_alarm->priority = priority;
+        new_alarm->on_fire = NULL;
+        new_alarm->context = NULL;
+        if (insert_alarm(new_alarm) != 0) {
+            free(new_alarm);
+            return;
+        }
+        check_and_insert(id);
+    } else if (sscanf(input, "Start_Alarm(%d): %d %99[^\n]", &id, &time, message) == 3) {
+        printf("Start Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, id, time);
+        // printf("Alarm ID: %d, Time: %d, Message: %s\n", id, time, message);
+        new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
+        if (new_alarm == NULL) {
+            fprintf(stderr, "Memory allocation failed for new alarm\n");
+            return;
+        }
+        new_alarm->id = id;
+        new_alarm->seconds = time;
+        strncpy(new_alarm->message, message, sizeof(new_alarm->message));
+        new_alarm->link = NULL;
+        new_alarm->Alarm_Time_Group_Number = (time + 4) / 5;
+        new_alarm->priority = ALARM_PRIORITY_DEFAULT;
+        new_alarm->on_fire = NULL;
+        new_alarm->context = NULL;
+        // printf("The group number is:%d\n",&new_alarm->Alarm_Time_Group_Number);
+        if (insert_alarm(new_alarm) != 0) {
+            free(new_alarm);
+            return;
+        }
+        check_and_insert(id);
+    } else if (sscanf(input, "Start_Alarm_At(%d): %ld %99[^\n]", &id, &at, message) == 3) {
+        printf("Start Alarm At Command Detected\n");
+        TRACE(TRACE_PARSE, id, (int)(at - alarm_now()));
+        new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
+        if (new_alarm == NULL) {
+            fprintf(stderr, "Memory allocation failed for new alarm\n");
+            return;
+        }
+        new_alarm->id = id;
+        strncpy(new_alarm->message, message, sizeof(new_alarm->message));
+        new_alarm->link = NULL;
+        new_alarm->priority = ALARM_PRIORITY_DEFAULT;
+        new_alarm->on_fire = NULL;
+        new_alarm->context = NULL;
+        if (insert_alarm_at(new_alarm, at) != 0) {
+            free(new_alarm);
+            return;
+        }
+        check_and_insert(id);
+    } else if (sscanf(input, "Pull_Alarm(%d): %d %99[^\n]", &id, &time, message) == 3) {
+        printf("Pull Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, id, time);
+        alarm_start_pull(id, time, ALARM_PRIORITY_DEFAULT, message);
+    } else if (strncmp(input, "Take_Expired", 12) == 0) {
+        alarm_t *taken[ALARM_SLICE_MAX];
+        int count;
+
+        // Take_Expired takes one; Take_Expired(n) a batch of up to n
+        if (sscanf(input, "Take_Expired(%d)", &count) != 1)
+            count = 1;
+        if (count < 1 || count > ALARM_SLICE_MAX) {
+            fprintf(stderr, "Take_Expired batch must be 1-%d alarms\n", ALARM_SLICE_MAX);
+            return;
+        }
+        // Blocks until something expires: stop holding up the alarm thread
+        command_leave();
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+        // Nobody else moves the virtual clock while its driver waits here
+        if (clock_advance_until(expired_ready) != 0) {
+            fprintf(stderr, "Take_Expired would wait forever: no pull alarm is pending\n");
+            return;
+        }
+#endif
+        count = alarm_take_batch(taken, count);
+        for (int i = 0; i < count; i++) {
+            printf("Expired Alarm(%d) due at %ld: %s\n",
+                   taken[i]->id, deadline_wall(taken[i]->time), taken[i]->message);
+            free(taken[i]);
+        }
+    } else if (sscanf(input, "Upsert_Alarm(%d): %d %99[^\n]", &id, &time, message) == 3) {
+        printf("Upsert Alarm Command Detected\n");
+        TRACE(TRACE_PARSE, id, time);
+        upsert_alarm(id, time, message);
+    } else if (strncmp(input, "Start_Alarms:", 13) == 0) {
+        alarm_t *batch[ALARM_BATCH_MAX];
+        const char *next = input + 13;
+        int count = 0, used, failed = 0;
+
+        // "Start_Alarms: id T message; id T message; ..."
+        printf("Start Alarms Command Detected\n");
+        while (count < ALARM_BATCH_MAX
+               && sscanf(next, " %d %d %99[^;\n]%n", &id, &time, message, &used) == 3) {
+            next += used;
+            if (*next == ';')
+                next++;
+            new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
+            if (new_alarm == NULL) {
+                fprintf(stderr, "Memory allocation failed for new alarm\n");
+                failed = 1;
+                break;
+            }
+            new_alarm->id = id;
+            new_alarm->seconds = time;
+            strncpy(new_alarm->message, message, sizeof(new_alarm->message));
+            new_alarm->link = NULL;
+            new_alarm->Alarm_Time_Group_Number = (time + 4) / 5;
+            new_alarm->priority = ALARM_PRIORITY_DEFAULT;
+            new_alarm->on_fire = NULL;
+            new_alarm->context = NULL;
+            batch[count++] = new_alarm;
+            TRACE(TRACE_PARSE, id, time);
+        }
+        // All or nothing: anything left over rejects the whole batch
+        next += strspn(next, " \t\r\n");
+        if (*next != '\0' || failed) {
+            if (!failed && count == ALARM_BATCH_MAX)
+                fprintf(stderr, "Start_Alarms takes at most %d alarms: none started\n",
+                        ALARM_BATCH_MAX);
+            else if (!failed)
+                fprintf(stderr, "Start_Alarms entry %d is not \"id T message\": none started\n",
+                        count + 1);
+            while (count > 0)
+                free(batch[--count]);
+            return;
+        }
+        insert_alarms(batch, count);
+    } else if (sscanf(input, "Cancel_Group(%d)", &id) == 1) {
+        printf("Cancel Group Command Detected\n");
+        printf("Cancelled %d Alarms in Alarm_Time_Group_Number %d at %ld\n",
+               cancel_alarms(INT_MIN, INT_MAX, id), id, alarm_now());
+    } else if (sscanf(input, "Cancel_Range(%d-%d)", &id, &time) == 2) {
+        printf("Cancel Range Command Detected\n");
+        printf("Cancelled %d Alarms with ids %d-%d at %ld\n",
+               cancel_alarms(id, time, ALARM_ANY_GROUP), id, time, alarm_now());
+    } else if (sscanf(input, "Shift_All: %d", &time) == 1) {
+        printf("Shift All Command Detected\n");
+        shift_all(time);
+        printf("All Alarms Shifted by %d at %ld\n", time, alarm_now());
+    } else if (sscanf(input, "Shift_Group(%d): %d", &id, &time) == 2) {
+        printf("Shift Group Command Detected\n");
+        printf("Shifted %d Alarms in Alarm_Time_Group_Number %d by %d at %ld\n",
+               shift_group(id, time), id, time, alarm_now());
+    } else if (sscanf(input, "Pause_Alarm(@%lx)", &handle) == 1) {
+        printf("Pause Alarm Command Detected\n");
+        if (pause_alarms(0, handle, ALARM_ANY_GROUP, 1) > 0)
+            printf("Alarm @%lx Paused at %ld\n", handle, alarm_now());
+    } else if (sscanf(input, "Pause_Alarm(%d)", &id) == 1) {
+        printf("Pause Alarm Command Detected\n");
+        if (pause_alarms(id, 0, ALARM_ANY_GROUP, 1) > 0)
+            printf("Alarm(%d) Paused at %ld\n", id, alarm_now());
+    } else if (sscanf(input, "Resume_Alarm(@%lx)", &handle) == 1) {
+        printf("Resume Alarm Command Detected\n");
+        if (pause_alarms(0, handle, ALARM_ANY_GROUP, 0) > 0)
+            printf("Alarm @%lx Resumed at %ld\n", handle, alarm_now());
+    } else if (sscanf(input, "Resume_Alarm(%d)", &id) == 1) {
+        printf("Resume Alarm Command Detected\n");
+        if (pause_alarms(id, 0, ALARM_ANY_GROUP, 0) > 0)
+            printf("Alarm(%d) Resumed at %ld\n", id, alarm_now());
+    } else if (sscanf(input, "Pause_Group(%d)", &id) == 1) {
+        printf("Pause Group Command Detected\n");
+        printf("Paused %d Alarms in Alarm_Time_Group_Number %d at %ld\n",
+               pause_alarms(0, 0, id, 1), id, alarm_now());
+    } else if (sscanf(input, "Resume_Group(%d)", &id) == 1) {
+        printf("Resume Group Command Detected\n");
+        printf("Resumed %d Alarms in Alarm_Time_Group_Number %d at %ld\n",
+               pause_alarms(0, 0, id, 0), id, alarm_now());
+    } else if (sscanf(input, "Cancel_Alarm(@%lx)", &handle) == 1) {
+        printf("Cancel Alarm Command Detected\n");
+        cancel_alarm(0, handle);
+    } else if (sscanf(input, "Cancel_Alarm(%d)", &id) == 1) {
+        printf("Cancel Alarm Command Detected\n");
+        cancel_alarm(id, 0);
+    } else if (sscanf(input, "Expiry_Slice(%d): %d", &id, &time) == 2) {
+        printf("Expiry Slice Command Detected\n");
+        if (id < 1 || id > ALARM_SLICE_MAX || time < 1) {
+            fprintf(stderr, "Expiry slice must be 1-%d alarms and at least 1 usec\n", ALARM_SLICE_MAX);
+            return;
+        }
+        alarm_lock();
+        slice_max_alarms = id;
+        slice_max_usec = time;
+        pthread_mutex_unlock(&alarm_mutex);
+    } else if (strncmp(input, "Command_Latency", 15) == 0) {
+        print_command_latency();
+    } else if (sscanf(input, "Trace_Dump(%99[^)])", message) == 1) {
+        trace_dump(message);
+    } else if (strncmp(input, "Stats", 5) == 0) {
+        print_stats();
+    } else {
+        printf("Unknown Command\n");
+        STAT_INC(unknown_commands);
+    }
+    
+ 
+    
+// display(alarm_list);
+}
+
+/*
+ * Apply one command line, recording how long it took including any
+ * wait for the alarm thread to finish its current expiry slice.
+ */
+void processInput(const char *input) {
+    struct timespec start;
+    long usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    command_enter();
+    TRACE(TRACE_COMMAND_BEGIN, -1, 0);
+
+    apply_command(input);
+    command_leave();
+
+    TRACE(TRACE_COMMAND_END, -1, 0);
+    // A take's time is spent waiting for alarms, not for the engine
+    if (strncmp(input, "Take_Expired", 12) == 0)
+        return;
+    usec = usec_since(&start);
+    atomic_fetch_add(&command_latency[latency_bucket(usec)], 1);
+}
+
+
+
+
+static void metrics_histogram(FILE *out, const char *name, const char *help,
+                              atomic_ulong *histogram, atomic_ulong *sum) {
+    unsigned long cumulative = 0;
+    int b;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        cumulative += atomic_load_explicit(&histogram[b], memory_order_relaxed);
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, latency_bound(b) / 1e6, cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram[b], memory_order_relaxed);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    fprintf(out, "%s_sum %g\n", name, atomic_load_explicit(sum, memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_count %lu\n", name, cumulative);
+}
+
+/*
+ * Render all metrics in the Prometheus text format. Reads atomics
+ * only, so a scrape never contends with the scheduler threads.
+ */
+void metrics_render(FILE *out) {
+    int i, count;
+
+    fprintf(out, "# HELP alarm_pending Alarms waiting to fire.\n"
+                 "# TYPE alarm_pending gauge\n"
+                 "alarm_pending %d\n", atomic_load(&pending_alarms));
+    fprintf(out, "# HELP alarm_display_threads Running display threads.\n"
+                 "# TYPE alarm_display_threads gauge\n"
+                 "alarm_display_threads %d\n", atomic_load(&display_thread_count));
+    fprintf(out, "# HELP alarm_group_pending Alarms waiting to fire per Alarm_Time_Group_Number.\n"
+                 "# TYPE alarm_group_pending gauge\n");
+    for (i = 0; i < GROUP_TABLE_SIZE; i++) {
+        if (atomic_load_explicit(&group_counts[i].used, memory_order_acquire) != GROUP_LIVE)
+            continue;
+        count = atomic_load_explicit(&group_counts[i].count, memory_order_relaxed);
+        if (count > 0)
+            fprintf(out, "alarm_group_pending{group=\"%d\"} %d\n",
+                    atomic_load_explicit(&group_counts[i].group, memory_order_relaxed), count);
+    }
+    fprintf(out, "# HELP alarm_group_untracked Alarms in groups alarm_group_pending has no room for.\n"
+                 "# TYPE alarm_group_untracked gauge\n"
+                 "alarm_group_untracked %d\n", atomic_load(&group_untracked));
+    metrics_histogram(out, "alarm_fire_lateness_seconds",
+                      "Delay between an alarm's deadline and its dispatch.",
+                      fire_lateness, &fire_lateness_sum);
+    metrics_histogram(out, "alarm_lock_wait_seconds",
+                      "Time spent waiting to acquire alarm_mutex.",
+                      lock_wait, &lock_wait_sum);
+}
+
+/*
+ * Serve metrics on a Unix stream socket. Each connection gets one
+ * rendering; a client that sends an HTTP request line gets an HTTP
+ * response, one that sends nothing within 100ms gets the bare text.
+ */
+void *metrics_thread(void *arg) {
+    const char *path = (const char *)arg;
+    struct sockaddr_un addr;
+    char request[256];
+    FILE *out;
+    int listener, client;
+    ssize_t length;
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        errno_abort("Create metrics socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        errno_abort("Bind metrics socket");
+    if (listen(listener, 16) < 0)
+        errno_abort("Listen on metrics socket");
+
+    while (1) {
+        client = accept(listener, NULL, NULL);
+        if (client < 0)
+            continue;
+        // Give an HTTP scraper a moment to send its request line
+        struct pollfd readable = { .fd = client, .events = POLLIN };
+        length = 0;
+        if (poll(&readable, 1, 100) > 0)
+            length = recv(client, request, sizeof(request) - 1, MSG_DONTWAIT);
+        request[length > 0 ? length : 0] = '\0';
+        out = fdopen(client, "w");
+        if (out == NULL) {
+            close(client);
+            continue;
+        }
+        if (strncmp(request, "GET ", 4) == 0)
+            fprintf(out, "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+        metrics_render(out);
+        fclose(out);
+    }
+    return NULL;
+}
+
+/*
+ * Shared-memory command submission. Local clients that would
+ * otherwise write a text line per command map a ring in FILE
+ * ("alarm_mutex --commands FILE") and fill fixed-size records in
+ * place; a single submit thread applies them straight to the engine
+ * without going through processInput's parser.
+ *
+ * The ring is a bounded MPSC queue: a producer claims position n by
+ * advancing tail, writes record n % SUBMIT_RING_SIZE, and publishes
+ * it by setting its seq to n + 1. The consumer frees the slot for
+ * the next lap by setting seq to n + SUBMIT_RING_SIZE. The doorbell
+ * is a futex word the consumer sets only before it goes to sleep, so
+ * a producer makes a syscall only when the consumer is idle.
+ * "alarm_mutex --submit FILE" is a client that reads Start_Alarm,
+ * Cancel_Alarm and Replace_Alarm lines and submits them as records.
+ */
+#define SUBMIT_MAGIC            0x414c5351u     /* "ALSQ" */
+#define SUBMIT_RING_SIZE        1024
+
+enum submit_op {
+    SUBMIT_START,
+    SUBMIT_CANCEL,
+    SUBMIT_REPLACE
+};
+
+typedef struct submit_record {
+    _Atomic uint64_t    seq;
+    int32_t             op;
+    int32_t             id;
+    int32_t             seconds;
+    int32_t             priority;
+    uint64_t            handle;
+    char                message[96];
+} submit_record_t;
+
+typedef struct submit_ring {
+    uint32_t            magic;
+    uint32_t            size;
+    _Atomic uint64_t    tail;           /* next position to claim */
+    char                pad1[CACHE_LINE - 16];
+    _Atomic uint64_t    head;           /* next position to apply */
+    _Atomic uint32_t    idle;           /* doorbell: consumer asleep */
+    char                pad2[CACHE_LINE - 12];
+    submit_record_t     records[SUBMIT_RING_SIZE];
+} submit_ring_t;
+
+static void *submit_map(const char *path, int create) {
+    void *ring;
+    int fd;
+
+    fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+    if (fd < 0)
+        errno_abort("Open submission ring");
+    if (create && ftruncate(fd, sizeof(submit_ring_t)) != 0)
+        errno_abort("Size submission ring");
+    ring = mmap(NULL, sizeof(submit_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        errno_abort("Map submission ring");
+    close(fd);
+    return ring;
+}
+
+/*
+ * Queue one command. Returns 0, or -1 if the ring is full, in which
+ * case the caller may retry once the scheduler has caught up.
+ */
+int alarm_submit(submit_ring_t *ring, int op, int id, int seconds, int priority,
+                 unsigned long handle, const char *message) {
+    submit_record_t *record;
+    uint64_t n, seq;
+
+    n = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        record = &ring->records[n % SUBMIT_RING_SIZE];
+        seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if (seq < n)
+            return -1;
+        if (seq == n) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &n, n + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else {
+            n = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    record->op = op;
+    record->id = id;
+    record->seconds = seconds;
+    record->priority = priority;
+    record->handle = handle;
+    strncpy(record->message, message != NULL ? message : "", sizeof(record->message) - 1);
+    record->message[sizeof(record->message) - 1] = '\0';
+    atomic_store_explicit(&record->seq, n + 1, memory_order_seq_cst);
+    // Pairs with the consumer's store to idle before its final check
+    if (atomic_load_explicit(&ring->idle, memory_order_seq_cst)
+            && atomic_exchange(&ring->idle, 0))
+        syscall(SYS_futex, &ring->idle, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return 0;
+}
+
+static void submit_apply(submit_record_t *record) {
+    switch (record->op) {
+    case SUBMIT_START:
+        if (record->priority < 0 || record->priority >= ALARM_PRIORITIES) {
+            fprintf(stderr, "Alarm priority %d out of range 0-%d\n",
+                    record->priority, ALARM_PRIORITIES - 1);
+            break;
+        }
+        if (record->seconds < 0)
+            break;
+        alarm_await(record->id, record->seconds, record->priority, record->message, NULL, NULL);
+        break;
+    case SUBMIT_CANCEL:
+        cancel_alarm(record->id, record->handle);
+        break;
+    case SUBMIT_REPLACE:
+        if (record->seconds >= 0)
+            replace_alarm(record->id, record->handle, record->seconds, record->message);
+        break;
+    default:
+        STAT_INC(unknown_commands);
+        break;
+    }
+}
+
+void *submit_thread(void *arg) {
+    submit_ring_t *ring = (submit_ring_t *)arg;
+    submit_record_t *record;
+    uint64_t n;
+
+    n = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1) {
+        record = &ring->records[n % SUBMIT_RING_SIZE];
+        if (atomic_load_explicit(&record->seq, memory_order_acquire) != n + 1) {
+            // Ring the doorbell on ourselves, then look once more
+            atomic_store_explicit(&ring->idle, 1, memory_order_seq_cst);
+            if (atomic_load_explicit(&record->seq, memory_order_seq_cst) != n + 1)
+                syscall(SYS_futex, &ring->idle, FUTEX_WAIT, 1, NULL, NULL, 0);
+            atomic_store_explicit(&ring->idle, 0, memory_order_relaxed);
+            continue;
+        }
+        // Counted like a command line, so expiry slices still yield
+        command_enter();
+        submit_apply(record);
+        command_leave();
+        atomic_store_explicit(&record->seq, n + SUBMIT_RING_SIZE, memory_order_release);
+        atomic_store_explicit(&ring->head, ++n, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/*
+ * Create the ring in FILE and start the thread that consumes it.
+ */
+void submit_start(const char *path) {
+    submit_ring_t *ring;
+    pthread_t thread;
+    int status;
+
+    ring = submit_map(path, 1);
+    for (int i = 0; i < SUBMIT_RING_SIZE; i++)
+        atomic_store_explicit(&ring->records[i].seq, i, memory_order_relaxed);
+    ring->size = SUBMIT_RING_SIZE;
+    atomic_thread_fence(memory_order_release);
+    ring->magic = SUBMIT_MAGIC;
+    status = pthread_create(&thread, NULL, submit_thread, ring);
+    if (status != 0)
+        err_abort(status, "Create submit thread");
+}
+
+/*
+ * Client side: turn command lines on stdin into records in the ring
+ * in FILE. The parsing happens here, in the client, so the scheduler
+ * never sees text.
+ */
+int submit_client(const char *path) {
+    submit_ring_t *ring;
+    struct timespec backoff = { 0, 100000 };
+    char line[128], message[100];
+    unsigned long handle;
+    int id, seconds, priority, op;
+
+    ring = submit_map(path, 0);
+    if (ring->magic != SUBMIT_MAGIC || ring->size != SUBMIT_RING_SIZE) {
+        fprintf(stderr, "%s is not an alarm submission ring\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        id = 0;
+        handle = 0;
+        seconds = 0;
+        priority = ALARM_PRIORITY_DEFAULT;
+        message[0] = '\0';
+        if (sscanf(line, "Start_Alarm(%d, %d): %d %99[^\n]", &id, &priority, &seconds, message) == 4
+                || sscanf(line, "Start_Alarm(%d): %d %99[^\n]", &id, &seconds, message) == 3) {
+            op = SUBMIT_START;
+        } else if (sscanf(line, "Replace_Alarm(@%lx): %d %99[^\n]", &handle, &seconds, message) == 3
+                || sscanf(line, "Replace_Alarm(%d): %d %99[^\n]", &id, &seconds, message) == 3) {
+            op = SUBMIT_REPLACE;
+        } else if (sscanf(line, "Cancel_Alarm(@%lx)", &handle) == 1
+                || sscanf(line, "Cancel_Alarm(%d)", &id) == 1) {
+            op = SUBMIT_CANCEL;
+        } else {
+            if (strlen(line) > 1)
+                fprintf(stderr, "Cannot submit: %s", line);
+            continue;
+        }
+        // A full ring means the scheduler is behind: wait for it
+        while (alarm_submit(ring, op, id, seconds, priority, handle, message) != 0)
+            nanosleep(&backoff, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Check that the id list, id index, handle table, pending stores and
+ * group counts all describe the same set of alarms. Must be called
+ * with alarm_mutex held. Returns the number of problems found, each
+ * reported on stderr.
+ */
+int audit_alarms(void) {
+    alarm_t *alarm, *prev = NULL;
+    int problems = 0, length = 0, stored = 0, paused = 0, count, p, i;
+
+    for (alarm = alarm_list; alarm != NULL; prev = alarm, alarm = alarm->link) {
+        length++;
+        paused += alarm->paused;
+        if (alarm->prev != prev)
+            problems++, fprintf(stderr, "audit: alarm %d has a bad back link\n", alarm->id);
+        if (prev != NULL && prev->id >= alarm->id)
+            problems++, fprintf(stderr, "audit: alarm %d out of id order\n", alarm->id);
+        if (find(alarm->id) != alarm)
+            problems++, fprintf(stderr, "audit: alarm %d missing from id index\n", alarm->id);
+        if (handle_lookup(alarm_handle(alarm)) != alarm)
+            problems++, fprintf(stderr, "audit: alarm %d has a stale handle\n", alarm->id);
+    }
+    for (p = 0; p < ALARM_PRIORITIES; p++)
+        stored += store_count(&alarm_stores[p]);
+    if (length != (int)id_count || length != stored + paused + wall_count
+            || length != atomic_load(&pending_alarms))
+        problems++, fprintf(stderr, "audit: %d alarms listed, %u indexed, %d stored, %d paused, "
+                            "%d on the wall clock, %d counted\n", length, id_count, stored, paused,
+                            wall_count, atomic_load(&pending_alarms));
+    for (i = 0; i < GROUP_TABLE_SIZE; i++) {
+        if (atomic_load(&group_counts[i].used) != GROUP_LIVE)
+            continue;
+        count = 0;
+        for (alarm = alarm_list; alarm != NULL; alarm = alarm->link)
+            if (alarm->Alarm_Time_Group_Number == atomic_load(&group_counts[i].group))
+                count++;
+        if (count != atomic_load(&group_counts[i].count))
+            problems++, fprintf(stderr, "audit: group %d has %d alarms, counted %d\n",
+                                atomic_load(&group_counts[i].group), count,
+                                atomic_load(&group_counts[i].count));
+    }
+    return problems;
+}
+
+/*
+ * Cancel every pending alarm, tearing down their display threads.
+ */
+void cancel_all_alarms(void) {
+    alarm_t *alarm;
+    int status, temp;
+
+    status = alarm_lock();
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    while ((alarm = alarm_list) != NULL) {
+        temp = alarm->Alarm_Time_Group_Number;
+        store_detach(alarm);
+        remove_alarm(&alarm_list, alarm);
+        free(alarm);
+        if (!has_alarms_in_group(temp))
+            terminate_display_thread_for_group(temp);
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+void start_alarm_thread(void) {
+    pthread_t thread;
+    int status, i;
+
+    if (fire_thread_count > 0) {
+        mq_init(&fire_queue, 2 * fire_thread_count);
+        if (sem_init(&fire_ready, 0, 0) != 0)
+            errno_abort("Init semaphore");
+        for (i = 0; i < fire_thread_count; i++) {
+            status = pthread_create(&thread, NULL, fire_thread, NULL);
+            if (status != 0)
+                err_abort(status, "Create firing thread");
+            pthread_detach(thread);
+        }
+    }
+
+#if ALARM_CLOCK != ALARM_CLOCK_VIRTUAL
+    // The alarm thread's timed waits are for monotonic deadlines
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    status = pthread_cond_init(&alarm_cond, &attr);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    pthread_condattr_destroy(&attr);
+#endif
+
+    // Create the alarm processing thread
+    status = pthread_create(&thread, NULL, alarm_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create alarm thread");
+    alarm_thread_id = thread;
+}
+
+typedef struct stress_worker {
+    pthread_t           thread;
+    unsigned int        seed;
+    int                 ops;
+} stress_worker_t;
+
+atomic_int stress_running;
+atomic_int stress_problems;
+atomic_ulong stress_local[64];
+
+/*
+ * Issue random commands over a small id range so that threads keep
+ * colliding on the same alarms, with short durations so that expiry
+ * races with replace and cancel.
+ */
+void *stress_thread(void *arg) {
+    stress_worker_t *worker = (stress_worker_t *)arg;
+    char line[128];
+    int i, id, seconds;
+
+    for (i = 0; i < worker->ops; i++) {
+        id = rand_r(&worker->seed) % 64;
+        seconds = rand_r(&worker->seed) % 4;
+        switch (rand_r(&worker->seed) % 13) {
+        case 12:
+            snprintf(line, sizeof(line), "%s_%s(%d)", seconds & 1 ? "Resume" : "Pause",
+                     seconds & 2 ? "Group" : "Alarm", seconds & 2 ? id % 2 : id);
+            break;
+        case 10:
+            if (seconds == 3)
+                snprintf(line, sizeof(line), "Shift_Group(%d): %d", id % 2, id % 3 - 1);
+            else if (seconds & 1)
+                snprintf(line, sizeof(line), "Cancel_Range(%d-%d)", id, id + 3);
+            else
+                snprintf(line, sizeof(line), "Cancel_Group(%d)", (seconds + 4) / 5);
+            break;
+        case 11:
+            if (seconds == 3) {
+                snprintf(line, sizeof(line), "Start_Alarm_At(%d): %ld wall %d", id,
+                         alarm_now() + rand_r(&worker->seed) % 3 - 1, i);
+                break;
+            }
+            snprintf(line, sizeof(line), "Start_Alarms: %d %d batch %d; %d %d batch %d; %d 1 batch %d",
+                     id, seconds, i, (id + 1) % 64, seconds, i, (id + 2) % 64, i);
+            break;
+        case 8:
+            // Local timers skip the command path; handles are shared so
+            // that some cancels come from other threads
+            atomic_store(&stress_local[id], local_alarm_start(seconds, "local", NULL, NULL));
+            continue;
+        case 9:
+            local_alarm_cancel(atomic_load(&stress_local[id]));
+            continue;
+        case 0: case 1:
+            snprintf(line, sizeof(line), "Start_Alarm(%d): %d stress %d", id, seconds, i);
+            break;
+        case 2:
+            snprintf(line, sizeof(line), "Start_Alarm(%d, %d): %d stress %d", id,
+                     rand_r(&worker->seed) % ALARM_PRIORITIES, seconds, i);
+            break;
+        case 3:
+            snprintf(line, sizeof(line), "Replace_Alarm(%d): %d replaced %d", id, seconds, i);
+            break;
+        case 4:
+            snprintf(line, sizeof(line), "Cancel_Alarm(%d)", id);
+            break;
+        case 5:
+            snprintf(line, sizeof(line), "Upsert_Alarm(%d): %d upserted %d", id, seconds, i);
+            break;
+        case 6:
+            snprintf(line, sizeof(line), "Cancel_Alarm(@%lx)",
+                     (unsigned long)(1 + rand_r(&worker->seed) % 4) << 32 | id);
+            break;
+        default:
+            snprintf(line, sizeof(line), "Replace_Alarm(@%lx): %d replaced %d",
+                     (unsigned long)(1 + rand_r(&worker->seed) % 4) << 32 | id, seconds, i);
+        }
+        processInput(line);
     }
     return NULL;
 }
 
-void remove_alarm(alarm_t **head, alarm_t *alarm) {
-    while (*head != NULL && *head != alarm) {
-        head = &(*head)->link;
-    }
-    if (*head != NULL) {
-        *head = (*head)->link;
+void *audit_thread(void *arg) {
+    struct timespec pause = { 0, 10000000 };
+
+    while (atomic_load(&stress_running)) {
+        alarm_lock();
+        atomic_fetch_add(&stress_problems, audit_alarms());
+        pthread_mutex_unlock(&alarm_mutex);
+        nanosleep(&pause, NULL);
     }
+    return NULL;
 }
 
-//check the alarm insert the display thread
-void check_and_insert(alarm_t *alarm) {
+/*
+ * Run threads workers of ops random commands each against the live
+ * engine while auditing every 10ms. Returns non-zero on any problem.
+ */
+int stress_test(int threads, int ops) {
+    stress_worker_t *workers;
+    pthread_t auditor;
+    int i, status;
 
-    int found = 0;
-    pthread_mutex_lock(&alarm_mutex);
-    pthread_mutex_lock(&display_mutex);
-    for (int i = 0; i < 10; i++) {
-        if (display_threads[i].time_group_number == alarm->Alarm_Time_Group_Number) {
-            
-            // A display thread for this group already exists
-            found = 1;
-            break;
-        }
+    workers = (stress_worker_t *)calloc(threads, sizeof(stress_worker_t));
+    if (workers == NULL)
+        errno_abort("Allocate stress workers");
+    start_alarm_thread();
+    atomic_store(&stress_running, 1);
+    status = pthread_create(&auditor, NULL, audit_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create audit thread");
+    for (i = 0; i < threads; i++) {
+        workers[i].seed = i + 1;
+        workers[i].ops = ops;
+        status = pthread_create(&workers[i].thread, NULL, stress_thread, &workers[i]);
+        if (status != 0)
+            err_abort(status, "Create stress thread");
     }
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    atomic_store(&stress_running, 0);
+    pthread_join(auditor, NULL);
 
-    if (!found) {
-
-        // Create a new display thread for this group
-        for (int i = 0; i < 100; i++) {
-        if (display_threads[i].time_group_number == 0) {  // 0 indicates unused slot
-            int *group_number_ptr = malloc(sizeof(int));
-            if (group_number_ptr == NULL) {
-                fprintf(stderr, "Memory allocation failed for group_number_ptr\n");
-                break; // or handle the error appropriately
-            }
-            *group_number_ptr = alarm->Alarm_Time_Group_Number;
-            display_threads[i].time_group_number = alarm->Alarm_Time_Group_Number;
-
-            // Create the thread
-            pthread_create(&display_threads[i].thread_id, NULL, display_alarm_thread, group_number_ptr);
-            
-            printf("Created New Display Alarm Thread %p for Alarm_Time_Group_Number %d to Display Alarm(%d) at %ld: %s\n",
-                (void*)display_threads[i].thread_id, 
-                *group_number_ptr, 
-                alarm->id, 
-                time(NULL), 
-                alarm->message);
-            break;
-    }
-}
-    }
+    cancel_all_alarms();
+    alarm_lock();
+    atomic_fetch_add(&stress_problems, audit_alarms());
     pthread_mutex_unlock(&alarm_mutex);
-    pthread_mutex_unlock(&display_mutex);
+    fprintf(stderr, "Stress: %d threads x %d commands, %d audit problems\n",
+            threads, ops, atomic_load(&stress_problems));
+    free(workers);
+    return atomic_load(&stress_problems) != 0;
 }
 
-
 /*
- * The alarm thread's start routine.
+ * Open-loop load generator. Commands are issued on a fixed schedule
+ * of rate per second whatever the engine is doing, and every latency
+ * is measured from when the command was meant to be sent, so a stall
+ * shows up in every command that queued behind it rather than only
+ * in the one that hit it (coordinated omission). Commands go through
+ * processInput as command lines, like a client's. Acknowledgement is
+ * processInput returning; the alarms are pull alarms whose message
+ * is the deadline they would have had if sent on time, and fire
+ * lateness is measured against it by a thread taking them as they
+ * expire. The engine's own output and complaints about ids that are
+ * taken or gone are discarded while it runs.
  */
-void terminate_display_thread_for_group(int group_number) {
-    // Implementation depends on how you manage threads
-    // Example:
-    for (int i = 0; i < 100; i++) {
-        if (display_threads[i].time_group_number == group_number) {
-            pthread_cancel(display_threads[i].thread_id); // Cancel the thread
-            display_threads[i].time_group_number = 0;    // Mark as unused
-            // Additional cleanup if necessary
-            break;
-        }
-    }
-}
+#define LOAD_IDS                1024
 
-void insert_alarm(alarm_t *alarm) {
-    alarm_t **last, *next;
-    int status;
+long *load_fire_usec;
+atomic_long load_fires;
+long load_fire_max;
 
-    status = pthread_mutex_lock(&alarm_mutex);
+void *load_taker(void *arg) {
+    struct timespec now;
+    alarm_t *alarm;
+    long late, i;
 
-    if (status != 0)
-        err_abort(status, "Lock mutex");
+    // The alarm with id LOAD_IDS marks the end of the run
+    while ((alarm = alarm_take())->id != LOAD_IDS) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = (now.tv_sec - atol(alarm->message)) * 1000000L + now.tv_nsec / 1000;
+        i = atomic_fetch_add(&load_fires, 1);
+        if (i < load_fire_max)
+            load_fire_usec[i] = late > 0 ? late : 0;
+        free(alarm);
+    }
+    free(alarm);
+    return NULL;
+}
 
-    alarm->time = time(NULL) + alarm->seconds;  // Set the absolute time for the alarm
+static int load_compare(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
 
-    // Start at the head of the list
-    last = &alarm_list;
-    next = *last;
+    return x < y ? -1 : x > y;
+}
 
-    // Iterate to find the insertion point
-    while (next != NULL && next->id < alarm->id) {
-        last = &next->link;
-        next = next->link;
-    }
+void load_percentiles(const char *name, long *samples, long n) {
+    static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+    int i;
 
-    // Get the current time for the insert_time
-    time_t insert_time;
-    time(&insert_time);
+    qsort(samples, n, sizeof(long), load_compare);
+    printf("  %-22s", name);
+    for (i = 0; i < 5; i++)
+        printf(" p%-5g %8ld", percentiles[i],
+               n > 0 ? samples[(long)((n - 1) * percentiles[i] / 100)] : 0L);
+    printf("  max %8ld usec\n", n > 0 ? samples[n - 1] : 0L);
+}
 
-    // Get the thread ID for the main thread
-    pthread_t thread_id = pthread_self();
-    printf("Alarm(%d) Inserted by Main Thread %lu Into Alarm List at %ld: %s\n",
-           alarm->id, 
-           (unsigned long)thread_id, 
-           insert_time, 
-           alarm->message);
-    // printf("Current head of list: %p\n", (void *)alarm_list);
-    // Insert the new alarm in the list
-    alarm->link = next;
-    *last = alarm;
-    // printf("New head of list: %p\n", (void *)alarm_list);
-    status = pthread_mutex_unlock(&alarm_mutex);
+int load_test(int rate, int seconds) {
+    struct timespec start, intended, sent, done;
+    long total = (long)rate * seconds, i, due;
+    long *ack_usec, *raw_usec;
+    unsigned int seed = 1;
+    int id, duration, op, saved, saved_err, devnull, status;
+    char line[128];
+    pthread_t taker;
+
+    if (rate < 1 || seconds < 1)
+        return 1;
+    ack_usec = (long *)calloc(total, sizeof(long));
+    raw_usec = (long *)calloc(total, sizeof(long));
+    load_fire_max = total;
+    load_fire_usec = (long *)calloc(total, sizeof(long));
+    if (ack_usec == NULL || raw_usec == NULL || load_fire_usec == NULL)
+        errno_abort("Allocate load samples");
+    start_alarm_thread();
+    status = pthread_create(&taker, NULL, load_taker, NULL);
     if (status != 0)
-        err_abort(status, "Unlock mutex");
+        err_abort(status, "Create load taker");
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    saved_err = dup(STDERR_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || saved_err < 0 || devnull < 0)
+        errno_abort("Redirect load output");
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
 
-}
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < total; i++) {
+        due = i * (1000000000L / rate);
+        intended.tv_sec = start.tv_sec + (start.tv_nsec + due) / 1000000000L;
+        intended.tv_nsec = (start.tv_nsec + due) % 1000000000L;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &intended, NULL) == EINTR)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        id = rand_r(&seed) % LOAD_IDS;
+        duration = 1 + rand_r(&seed) % 3;
+        op = rand_r(&seed) % 10;
+        if (op < 6)
+            snprintf(line, sizeof(line), "Pull_Alarm(%d): %d %ld",
+                     id, duration, (long)intended.tv_sec + duration);
+        else if (op < 8)
+            snprintf(line, sizeof(line), "Replace_Alarm(%d): %d %ld",
+                     id, duration, (long)intended.tv_sec + duration);
+        else
+            snprintf(line, sizeof(line), "Cancel_Alarm(%d)", id);
+        processInput(line);
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        ack_usec[i] = (done.tv_sec - intended.tv_sec) * 1000000L
+            + (done.tv_nsec - intended.tv_nsec) / 1000;
+        raw_usec[i] = (done.tv_sec - sent.tv_sec) * 1000000L
+            + (done.tv_nsec - sent.tv_nsec) / 1000;
+    }
+    // Let the last alarms fire, then stop the taker
+    sleep(5);
+    alarm_start_pull(LOAD_IDS, 0, ALARM_PRIORITY_DEFAULT, "done");
+    pthread_join(taker, NULL);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(devnull);
+    close(saved);
+    close(saved_err);
 
-alarm_t* find(alarm_t *head, int id) {
-    alarm_t *current = head;
+    printf("load rate=%d/s seconds=%d commands=%ld fires=%ld\n",
+           rate, seconds, total, atomic_load(&load_fires));
+    load_percentiles("ack (from intended)", ack_usec, total);
+    load_percentiles("ack (from sent)", raw_usec, total);
+    load_percentiles("fire lateness", load_fire_usec,
+                     atomic_load(&load_fires) < load_fire_max ? atomic_load(&load_fires) : load_fire_max);
+    free(ack_usec);
+    free(raw_usec);
+    return 0;
+}
 
-    // Check if the head is NULL before accessing it
-    // if (head != NULL) {
-    //     printf("The head ID: %d\n", head->id);
-    // } else {
-    //     printf("Head is NULL\n");
-    // }
+#ifdef ALARM_FUZZ
+/*
+ * libFuzzer entry point: each input is a batch of command lines fed
+ * through processInput against the running engine, which is then
+ * audited and emptied so inputs stay independent.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    char line[128];
+    size_t i, length = 0;
 
-    while (current != NULL) {
-        if (current->id == id) {
-            return current; // Alarm found, return a pointer to it
+    pthread_once(&once, start_alarm_thread);
+    for (i = 0; i <= size; i++) {
+        if (i == size || data[i] == '\n') {
+            line[length] = '\0';
+            // Do not let the fuzzer write files, or wait on an expiry
+            if (length > 0 && strncmp(line, "Trace_Dump", 10) != 0
+                    && strncmp(line, "Take_Expired", 12) != 0)
+                processInput(line);
+            length = 0;
+        } else if (length < sizeof(line) - 1) {
+            line[length++] = data[i];
         }
-        current = current->link;
     }
-    return NULL; // Alarm not found
+    alarm_lock();
+    if (audit_alarms() != 0)
+        abort();
+    pthread_mutex_unlock(&alarm_mutex);
+    cancel_all_alarms();
+    return 0;
 }
+#endif
 
-int has_alarms_in_group(int group_number) {
-    alarm_t *current = alarm_list;
-    while (current != NULL) {
-        if (current->Alarm_Time_Group_Number == group_number) {
-            return 1; // Alarm found in the group
-        }
-        current = current->link;
-    }
-    return 0; // No alarms found in the group
+static double bench_elapsed(struct timespec *start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
 }
 
-void *alarm_thread (void *arg) {
-    alarm_t *alarm;
-    int sleep_time;
-    time_t now;
-    int status, temp;
+/*
+ * Alarm durations for the benchmark: uniform over an hour, or
+ * log-uniform from one second to about a day, which is closer to a
+ * real mix of many short timeouts and a few long reminders.
+ */
+static int bench_duration(int mixed) {
+    int exponent;
 
-    while (1) {
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Lock mutex");
+    if (!mixed)
+        return 1 + rand() % 3600;
+    exponent = rand() % 17;
+    return (1 << exponent) + rand() % (1 << exponent);
+}
 
-        alarm = alarm_list;
-        now = time(NULL);
+/*
+ * Time the compiled store/lock/clock combination: insert n alarms,
+ * cancel a quarter of them, then drain the rest in firing order.
+ * Each operation takes the lock and reads the clock as the engine
+ * does. Finally run the classic "hold" model on one class: n times,
+ * fire the earliest alarm and re-arm it for a new duration later.
+ */
+void bench_store(int n, const char *distribution) {
+    alarm_t *alarms, *alarm;
+    struct timespec start;
+    time_t last, latest = 0;
+    int i, p, popped = 0, misordered = 0;
+    int mixed = distribution != NULL && strcmp(distribution, "mixed") == 0;
 
-        if (alarm == NULL) {
-            sleep_time = 1;
-        } else {
-            if (alarm->time <= now) {
-                // Time for this alarm has come
-                sleep_time = 0;
-
-                // Remove the alarm from the list
-                temp = alarm->Alarm_Time_Group_Number;
-                remove_alarm(&alarm_list, alarm);
-                if(!has_alarms_in_group(temp)){
-                    terminate_display_thread_for_group(temp);
-                    printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
-                        temp, time(NULL));
-                }
-                // Unlock the mutex before processing the alarm to allow other threads to work
-                status = pthread_mutex_unlock(&alarm_mutex);
-                if (status != 0)
-                    err_abort(status, "Unlock mutex");
+    alarms = (alarm_t *)calloc(n, sizeof(alarm_t));
+    if (alarms == NULL)
+        errno_abort("Allocate bench alarms");
+    srand(1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        alarms[i].id = i;
+        alarms[i].seconds = bench_duration(mixed);
+        alarms[i].priority = rand() % ALARM_PRIORITIES;
+        pthread_mutex_lock(&alarm_mutex);
+        alarms[i].time = alarm_now() + alarms[i].seconds;
+        store_push(&alarm_stores[alarms[i].priority], &alarms[i]);
+        pthread_mutex_unlock(&alarm_mutex);
+    }
+    printf("store=%s lock=%s clock=%s n=%d durations=%s\n",
+           ALARM_STORE_NAME, ALARM_LOCK_NAME, ALARM_CLOCK_NAME, n,
+           mixed ? "mixed" : "uniform");
+    printf("  insert %8.1f ns/op\n", bench_elapsed(&start) / n);
 
-                // Process the alarm
-                printf("(%d) %s\n", alarm->seconds, alarm->message);
-                free(alarm); // Assuming alarm is dynamically allocated
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i += 4) {
+        pthread_mutex_lock(&alarm_mutex);
+        store_remove(&alarm_stores[alarms[i].priority], &alarms[i]);
+        pthread_mutex_unlock(&alarm_mutex);
+    }
+    printf("  cancel %8.1f ns/op\n", bench_elapsed(&start) / ((n + 3) / 4));
 
-                continue; // Continue to the next iteration of the loop
-            } else {
-                // Calculate the time to sleep
-                sleep_time = alarm->time - now;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (p = 0; p < ALARM_PRIORITIES; p++) {
+        last = 0;
+        while (1) {
+            pthread_mutex_lock(&alarm_mutex);
+            alarm = store_top(&alarm_stores[p]);
+            if (alarm != NULL)
+                store_pop(&alarm_stores[p], alarm);
+            pthread_mutex_unlock(&alarm_mutex);
+            if (alarm == NULL)
+                break;
+            if (alarm->time < last)
+                misordered++;
+            last = alarm->time;
+            if (last > latest)
+                latest = last;
+            popped++;
         }
+    }
+    printf("  pop    %8.1f ns/op\n", bench_elapsed(&start) / (popped ? popped : 1));
+    if (misordered != 0 || popped != n - (n + 3) / 4)
+        printf("  ERROR: %d alarms popped out of order, %d of %d popped\n",
+               misordered, popped, n - (n + 3) / 4);
 
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Unlock mutex");
-        if (sleep_time > 0)
-            sleep(sleep_time);
-        else
-            sched_yield();
-        
+    // Carry on from the last deadline fired above, as the clock would
+    for (i = 0; i < n; i++) {
+        alarms[i].time = latest + bench_duration(mixed);
+        store_push(&alarm_stores[0], &alarms[i]);
+    }
+    misordered = 0;
+    last = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        pthread_mutex_lock(&alarm_mutex);
+        alarm = store_top(&alarm_stores[0]);
+        store_pop(&alarm_stores[0], alarm);
+        if (alarm->time < last)
+            misordered++;
+        last = alarm->time;
+        alarm->time += bench_duration(mixed);
+        store_push(&alarm_stores[0], alarm);
+        pthread_mutex_unlock(&alarm_mutex);
     }
+    printf("  hold   %8.1f ns/op\n", bench_elapsed(&start) / n);
+    if (misordered != 0)
+        printf("  ERROR: %d alarms fired out of order while holding\n", misordered);
+    free(alarms);
 }
 
+/*
+ * Skip list scaling: producers insert their share of n nodes and
+ * cancel every fourth one they inserted, while one consumer pops from
+ * the head until the producers are done and the list is empty. Run
+ * lock-free, then with a global mutex around every operation as the
+ * engine does today. Nodes are allocated up front and only freed once
+ * a run is over, since a popped node may still be under a producer.
+ */
+typedef struct skip_bench {
+    skip_list_t         *list;
+    skip_node_t         **nodes;
+    int                 first, count;
+    pthread_mutex_t     *mutex;         /* NULL: lock-free */
+    atomic_int          *producers;
+    atomic_int          *removed;
+} skip_bench_t;
 
-void replace_alarm(int alarm_id, int seconds, const char *message) {
-    alarm_t *foundAlarm, *newAlarm;
-    int status, temp;
-    time_t new_time = time(NULL) + seconds;
-
-    //status = pthread_mutex_lock(&alarm_mutex);
-    // if (status != 0)
-    //     err_abort(status, "Lock mutex");
-
-    foundAlarm = find(alarm_list, alarm_id);
+void *skip_producer(void *arg) {
+    skip_bench_t *bench = (skip_bench_t *)arg;
+    int i, won;
 
-    if (foundAlarm != NULL) {
-        // Remove the existing alarm from the list
-        temp = foundAlarm->Alarm_Time_Group_Number;
-        remove_alarm(&alarm_list, foundAlarm);
-        if(!has_alarms_in_group(temp)){
-            terminate_display_thread_for_group(temp);
-            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
-                temp, time(NULL));
-        }
-        // Allocate and set up a new alarm
-        newAlarm = (alarm_t *)malloc(sizeof(alarm_t));
+    for (i = bench->first; i < bench->first + bench->count; i++) {
+        if (bench->mutex != NULL)
+            pthread_mutex_lock(bench->mutex);
+        skip_insert(bench->list, bench->nodes[i]);
+        if (bench->mutex != NULL)
+            pthread_mutex_unlock(bench->mutex);
+    }
+    for (i = bench->first; i < bench->first + bench->count; i += 4) {
+        if (bench->mutex != NULL)
+            pthread_mutex_lock(bench->mutex);
+        won = skip_remove(bench->list, bench->nodes[i]);
+        if (bench->mutex != NULL)
+            pthread_mutex_unlock(bench->mutex);
+        if (won)
+            atomic_fetch_add(bench->removed, 1);
+    }
+    atomic_fetch_sub(bench->producers, 1);
+    return NULL;
+}
 
-        newAlarm->id = alarm_id;
-        newAlarm->seconds = seconds;
-        newAlarm->time = new_time;
-        newAlarm->Alarm_Time_Group_Number = (seconds + 4) / 5;
-        strncpy(newAlarm->message, message, sizeof(newAlarm->message) - 1);
-        newAlarm->message[sizeof(newAlarm->message) - 1] = '\0';
+void *skip_consumer(void *arg) {
+    skip_bench_t *bench = (skip_bench_t *)arg;
+    skip_node_t *node;
+    int done;
 
-        // Insert the new alarm into the list
-        insert_alarm(newAlarm);
+    while (1) {
+        done = atomic_load(bench->producers) == 0;
+        if (bench->mutex != NULL)
+            pthread_mutex_lock(bench->mutex);
+        node = skip_pop(bench->list);
+        if (bench->mutex != NULL)
+            pthread_mutex_unlock(bench->mutex);
+        if (node != NULL)
+            atomic_fetch_add(bench->removed, 1);
+        else if (done)
+            break;
+    }
+    return NULL;
+}
 
-        // Free the memory of the old alarm, if dynamically allocated
-        free(foundAlarm);
+void bench_skiplist(int n) {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    skip_bench_t workers[64 + 1];
+    pthread_t threads[64 + 1];
+    skip_node_t **nodes;
+    skip_list_t list;
+    atomic_int producers, removed;
+    struct timespec start;
+    double ns;
+    int t, i, locked, status;
 
-        printf("Alarm(%d) Replaced at %ld: %s\n", alarm_id, seconds, message);
-    } else {
-        // Handle the case where the alarm is not found
-        fprintf(stderr, "Alarm ID %d not found\n", alarm_id);
+    nodes = (skip_node_t **)calloc(n, sizeof(skip_node_t *));
+    if (nodes == NULL)
+        errno_abort("Allocate bench nodes");
+    printf("skiplist n=%d (ops/s: inserts + cancels + pops)\n", n);
+    printf("  threads %14s %14s\n", "lock-free", "mutex");
+    for (t = 1; t <= 64; t *= 2) {
+        printf("  %7d", t);
+        for (locked = 0; locked < 2; locked++) {
+            srand(1);
+            for (i = 0; i < n; i++)
+                nodes[i] = skip_node_new(rand() % 86400, i, skip_random_level());
+            skip_init(&list);
+            atomic_init(&producers, t);
+            atomic_init(&removed, 0);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i <= t; i++) {
+                workers[i].list = &list;
+                workers[i].nodes = nodes;
+                workers[i].first = i < t ? (long)n * i / t : 0;
+                workers[i].count = i < t ? (long)n * (i + 1) / t - workers[i].first : 0;
+                workers[i].mutex = locked ? &mutex : NULL;
+                workers[i].producers = &producers;
+                workers[i].removed = &removed;
+                status = pthread_create(&threads[i], NULL,
+                                        i < t ? skip_producer : skip_consumer, &workers[i]);
+                if (status != 0)
+                    err_abort(status, "Create bench thread");
+            }
+            for (i = 0; i <= t; i++)
+                pthread_join(threads[i], NULL);
+            ns = bench_elapsed(&start);
+            printf(" %14.0f", (n + atomic_load(&removed)) / (ns / 1e9));
+            if (atomic_load(&removed) != n || atomic_load(&list.count) != 0)
+                printf(" ERROR: %d of %d removed", atomic_load(&removed), n);
+            for (i = 0; i < n; i++)
+                free(nodes[i]);
+            skip_destroy(&list);
+        }
+        printf("\n");
     }
-
-    // status = pthread_mutex_unlock(&alarm_mutex);
-    // if (status != 0)
-    //     err_abort(status, "Unlock mutex");
+    free(nodes);
 }
 
+/*
+ * MultiQueue drain: n alarms with distinct deadlines are queued up
+ * front, then threads pop until the queue is empty, each pop taking a
+ * ticket for the order it completed in. The rank error of a pop is
+ * how many earlier deadlines were still queued at that point, counted
+ * afterwards with a Fenwick tree. One heap is the strict baseline.
+ */
+typedef struct mq_bench {
+    multiqueue_t        *mq;
+    atomic_int          *ticket;
+    time_t              *order;
+} mq_bench_t;
 
+void *mq_bench_thread(void *arg) {
+    mq_bench_t *bench = (mq_bench_t *)arg;
+    alarm_t *alarm;
 
-void cancel_alarm(int alarm_id) {
-    alarm_t *foundAlarm;
-    int status, tempGroupNumber;
+    while ((alarm = mq_pop(bench->mq)) != NULL)
+        bench->order[atomic_fetch_add(bench->ticket, 1)] = alarm->time;
+    return NULL;
+}
 
-    status = pthread_mutex_lock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Lock mutex");
+void bench_multiqueue(int n, int threads) {
+    alarm_t *alarms;
+    time_t *order;
+    int *fenwick;
+    multiqueue_t mq;
+    mq_bench_t bench;
+    pthread_t *workers;
+    atomic_int ticket;
+    struct timespec start;
+    double ns, total;
+    long max;
+    int run, i, j, k, below, status;
 
-    // Find the alarm to cancel
-    foundAlarm = find(alarm_list, alarm_id);
+    if (n < 1 || threads < 1)
+        return;
+    alarms = (alarm_t *)calloc(n, sizeof(alarm_t));
+    order = (time_t *)calloc(n, sizeof(time_t));
+    fenwick = (int *)calloc(n + 1, sizeof(int));
+    workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (alarms == NULL || order == NULL || fenwick == NULL || workers == NULL)
+        errno_abort("Allocate bench");
+    printf("multiqueue n=%d threads=%d\n", n, threads);
+    printf("  %-8s %7s %14s %12s %10s\n", "mode", "heaps", "pops/s", "mean rank", "max rank");
+    for (run = 0; run < 2; run++) {
+        // Deadlines are a shuffled 0..n-1, so a deadline is its rank
+        for (i = 0; i < n; i++) {
+            alarms[i].id = i;
+            alarms[i].time = i;
+        }
+        srand(1);
+        for (i = n - 1; i > 0; i--) {
+            j = rand() % (i + 1);
+            k = alarms[i].time;
+            alarms[i].time = alarms[j].time;
+            alarms[j].time = k;
+        }
+        mq_init(&mq, run == 0 ? 1 : 2 * threads);
+        for (i = 0; i < n; i++)
+            mq_push(&mq, &alarms[i]);
+        atomic_init(&ticket, 0);
+        bench.mq = &mq;
+        bench.ticket = &ticket;
+        bench.order = order;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < threads; i++) {
+            status = pthread_create(&workers[i], NULL, mq_bench_thread, &bench);
+            if (status != 0)
+                err_abort(status, "Create bench thread");
+        }
+        for (i = 0; i < threads; i++)
+            pthread_join(workers[i], NULL);
+        ns = bench_elapsed(&start);
 
-    if (foundAlarm != NULL) {
-        // Store the group number before removing the alarm
-        tempGroupNumber = foundAlarm->Alarm_Time_Group_Number;
+        memset(fenwick, 0, (n + 1) * sizeof(int));
+        total = 0;
+        max = 0;
+        for (i = 0; i < n; i++) {
+            // Deadlines below order[i] popped so far
+            for (below = 0, k = order[i]; k > 0; k -= k & -k)
+                below += fenwick[k];
+            total += order[i] - below;
+            if (order[i] - below > max)
+                max = order[i] - below;
+            for (k = order[i] + 1; k <= n; k += k & -k)
+                fenwick[k]++;
+        }
+        printf("  %-8s %7d %14.0f %12.2f %10ld\n", run == 0 ? "strict" : "relaxed",
+               mq.nheaps, n / (ns / 1e9), total / n, max);
+        mq_destroy(&mq);
+    }
+    free(alarms);
+    free(order);
+    free(fenwick);
+    free(workers);
+}
 
-        // Remove the alarm from the list
-        remove_alarm(&alarm_list, foundAlarm);
+/*
+ * Insert/cancel throughput through the real engine entry points from
+ * 1 to max_threads threads, first on the plain mutex and then flat
+ * combining. Each thread keeps a window of 64 of its own alarms
+ * pending, cancelling the oldest as it inserts a new one. The
+ * engine's own output is sent to /dev/null while timing.
+ */
+typedef struct combine_bench {
+    int                 base, ops;
+} combine_bench_t;
 
-        // Free the alarm structure
-        free(foundAlarm);
+void *combine_bench_thread(void *arg) {
+    combine_bench_t *bench = (combine_bench_t *)arg;
+    alarm_t *alarm;
+    int i;
 
-        // Check if any alarms are left in the removed alarm's group
-        if (!has_alarms_in_group(tempGroupNumber)) {
-            // Terminate the display thread for this group
-            terminate_display_thread_for_group(tempGroupNumber);
-            printf("Display Alarm Thread for Alarm_Time_Group_Number %d Terminated at %ld\n",
-                tempGroupNumber, time(NULL));
+    for (i = 0; i < bench->ops + 64; i++) {
+        if (i < bench->ops) {
+            alarm = (alarm_t *)calloc(1, sizeof(alarm_t));
+            if (alarm == NULL)
+                errno_abort("Allocate bench alarm");
+            alarm->id = bench->base + i;
+            alarm->seconds = 3600;
+            alarm->Alarm_Time_Group_Number = (3600 + 4) / 5;
+            alarm->priority = ALARM_PRIORITY_DEFAULT;
+            strcpy(alarm->message, "bench");
+            if (insert_alarm(alarm) != 0)
+                free(alarm);
         }
-    } else {
-        fprintf(stderr, "Alarm ID %d not found\n", alarm_id);
+        if (i >= 64)
+            cancel_alarm(bench->base + i - 64, 0);
     }
-
-    status = pthread_mutex_unlock(&alarm_mutex);
-    if (status != 0)
-        err_abort(status, "Unlock mutex");
+    return NULL;
 }
 
-void processInput(const char *input) {
-    int id, time, check;
-    alarm_t *foundAlarm;
-    char message[100]; // Adjust size as needed
-    alarm_t *new_alarm;
-    if (sscanf(input, "Replace_Alarm(%d): %d %[^\n]", &id, &time, message) == 3) {
-        printf("Replace Alarm Command Detected\n");
-        // printf("Alarm ID: %d, Time: %d, Message: %s\n", id, time, message);
-        foundAlarm = find(alarm_list, id);
-        if(foundAlarm != NULL){
-            replace_alarm(id, time, message);
-            printf("replace alarm sussccesful");
-            check_and_insert(new_alarm);
-        }
-        else{
-            fprintf(stderr, "Alarm ID %d not found\n", id);
+void bench_combining(int n, int max_threads) {
+    combine_bench_t workers[64];
+    pthread_t threads[64];
+    struct timespec start;
+    double ns[2];
+    int t, i, mode, status, saved, devnull;
+
+    if (max_threads > 64)
+        max_threads = 64;
+    printf("combining n=%d (insert + cancel per op)\n", n);
+    printf("  threads %14s %14s\n", "mutex ops/s", "combining ops/s");
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devnull < 0)
+        errno_abort("Redirect bench output");
+    for (t = 1; t <= max_threads; t *= 2) {
+        for (mode = 0; mode < 2; mode++) {
+            flat_combining = mode;
+            fflush(stdout);
+            dup2(devnull, STDOUT_FILENO);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < t; i++) {
+                workers[i].base = i * (n + 64);
+                workers[i].ops = n / t;
+                status = pthread_create(&threads[i], NULL, combine_bench_thread, &workers[i]);
+                if (status != 0)
+                    err_abort(status, "Create bench thread");
+            }
+            for (i = 0; i < t; i++)
+                pthread_join(threads[i], NULL);
+            ns[mode] = bench_elapsed(&start);
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
         }
-        
-    } else if (sscanf(input, "Start_Alarm(%d): %d %[^\n]", &id, &time, message) == 3) {
-        printf("Start Alarm Command Detected\n");
-        // printf("Alarm ID: %d, Time: %d, Message: %s\n", id, time, message);
-        new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        new_alarm->id = id;
-        new_alarm->seconds = time;
-        strncpy(new_alarm->message, message, sizeof(new_alarm->message));
-        new_alarm->link = NULL;
-        new_alarm->Alarm_Time_Group_Number = (time + 4) / 5;
-        // printf("The group number is:%d\n",&new_alarm->Alarm_Time_Group_Number);
-        insert_alarm(new_alarm);
-        check_and_insert(new_alarm);
-    }else if (sscanf(input, "Cancel_Alarm(%d)", &id) == 1) {
-        printf("Cancel Alarm Command Detected\n");
-        cancel_alarm(id);
-    } else {
-        printf("Unknown Command\n");
+        printf("  %7d %14.0f %14.0f\n", t, (n / t) * t / (ns[0] / 1e9),
+               (n / t) * t / (ns[1] / 1e9));
+        fflush(stdout);
     }
-    
- 
-    
-// display(alarm_list);
+    flat_combining = 0;
+    close(devnull);
+    close(saved);
 }
 
-
-
-
+#ifndef ALARM_FUZZ
 int main(int argc, char *argv[]) {
     int status;
     char line[128];
     alarm_t *alarm;
     pthread_t thread;
-    // Create the alarm processing thread
-    status = pthread_create(&thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort(status, "Create alarm thread");
+    const char *metrics_path = getenv("ALARM_METRICS_SOCKET");
+    const char *commands_path = getenv("ALARM_COMMANDS_FILE");
+    int i;
+
+    clock_init();
+    if (getenv("ALARM_EVENTS_FILE") != NULL)
+        event_open(getenv("ALARM_EVENTS_FILE"));
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_store(atoi(argv[i + 1]), i + 2 < argc ? argv[i + 2] : NULL);
+            return 0;
+        } else if (strcmp(argv[i], "--bench-skiplist") == 0 && i + 1 < argc) {
+            bench_skiplist(atoi(argv[i + 1]));
+            return 0;
+        } else if (strcmp(argv[i], "--bench-multiqueue") == 0 && i + 2 < argc) {
+            bench_multiqueue(atoi(argv[i + 1]), atoi(argv[i + 2]));
+            return 0;
+        } else if (strcmp(argv[i], "--bench-combining") == 0 && i + 2 < argc) {
+            bench_combining(atoi(argv[i + 1]), atoi(argv[i + 2]));
+            return 0;
+        } else if (strcmp(argv[i], "--combining") == 0) {
+            flat_combining = 1;
+        } else if (strcmp(argv[i], "--fire-threads") == 0 && i + 1 < argc) {
+            fire_thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stress") == 0 && i + 2 < argc) {
+            return stress_test(atoi(argv[i + 1]), atoi(argv[i + 2]));
+        } else if (strcmp(argv[i], "--load") == 0 && i + 2 < argc) {
+            return load_test(atoi(argv[i + 1]), atoi(argv[i + 2]));
+        } else if (strcmp(argv[i], "--trace-to-chrome") == 0 && i + 1 < argc) {
+            return trace_to_chrome(argv[i + 1]);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+            // Opened at once so that the modes after it publish too
+            event_open(argv[++i]);
+        } else if (strcmp(argv[i], "--subscribe") == 0 && i + 1 < argc) {
+            return event_subscribe(argv[i + 1]);
+        } else if (strcmp(argv[i], "--commands") == 0 && i + 1 < argc) {
+            commands_path = argv[++i];
+        } else if (strcmp(argv[i], "--submit") == 0 && i + 1 < argc) {
+            return submit_client(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s [--bench N [uniform|mixed]] [--bench-skiplist N] [--bench-multiqueue N THREADS] [--bench-combining N THREADS] [--combining] [--fire-threads N] [--stress THREADS OPS] [--load RATE SECONDS] [--trace-to-chrome FILE] [--metrics SOCKET] [--events FILE] [--subscribe FILE] [--commands FILE] [--submit FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (metrics_path != NULL) {
+        // A scraper hanging up early must not kill the process
+        signal(SIGPIPE, SIG_IGN);
+        status = pthread_create(&thread, NULL, metrics_thread, (void *)metrics_path);
+        if (status != 0)
+            err_abort(status, "Create metrics thread");
+    }
+    start_alarm_thread();
+    if (commands_path != NULL)
+        submit_start(commands_path);
     // Main loop to read and process commands
     // alarm = (alarm_t *)malloc(sizeof(alarm_t));
     // alarm->id = 0;
@@ -417,15 +5498,32 @@ int main(int argc, char *argv[]) {
     // insert_alarm(alarm);
     while (1) {
         printf("alarm> ");
-        if (fgets(line, sizeof(line), stdin) == NULL) exit(0);
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+            clock_advance(CLOCK_FOREVER);
+#endif
+            exit(0);
+        }
         if (strlen(line) <= 1) continue;
         if (strlen(line) > 128) {
             line[128] = '\0';
         }
+#if ALARM_CLOCK == ALARM_CLOCK_VIRTUAL
+        // "@T command": let T seconds since start-up pass first
+        long at;
+        int skip = 0;
+        if (sscanf(line, "@%ld %n", &at, &skip) == 1 && skip > 0) {
+            clock_advance(virtual_start + at);
+            if (line[skip] == '\0')
+                continue;
+        }
+        processInput(line + skip);
+#else
         processInput(line);
+#endif
         
     }
 
 
 }
-
+#endif
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# bench_policies.sh [N [THREADS]]
+#
+# Build alarm_mutex once for every compile-time store, lock and clock
+# policy and run its benchmarks: "--bench N" in both duration mixes,
+# and for each lock "--bench-combining N THREADS", which compares the
+# lock against flat combining, the single-owner alternative to it.
+# The virtual clock is left out since it does not move on its own.
+#
+# CC and CFLAGS are honoured, e.g. CFLAGS=-I/path/to/errors.h/dir.
+#
+N=${1:-100000}
+THREADS=${2:-8}
+CC=${CC:-cc}
+SOURCE="$(dirname "$0")/alarm_mutex (8).c"
+BINARY=${TMPDIR:-/tmp}/alarm_policy.$$
+
+trap 'rm -f "$BINARY"' EXIT
+
+for lock in MUTEX ADAPTIVE; do
+    for clock in PRECISE COARSE; do
+        for store in HEAP LIST WHEEL RADIX SKIPLIST CALENDAR; do
+            $CC -O2 -pthread $CFLAGS -DALARM_STORE=ALARM_STORE_$store \
+                -DALARM_LOCK=ALARM_LOCK_$lock -DALARM_CLOCK=ALARM_CLOCK_$clock \
+                -o "$BINARY" "$SOURCE" || exit 1
+            "$BINARY" --bench "$N" uniform
+            "$BINARY" --bench "$N" mixed
+        done
+    done
+    echo "lock=$(echo $lock | tr A-Z a-z)"
+    "$BINARY" --bench-combining "$N" "$THREADS"
+done